@@ -0,0 +1,53 @@
+#!/bin/sh
+# Checks that flex2sr and sr2flex batch mode (-l) make the same number of
+# allocations for many files as for one, so none are made per file.
+# Run by make check, with mallocount.so built.
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+many=100
+result=0
+
+# A small FLEX binary, and the S-records for it
+printf '\002\001\000\004ABCD\002\020\000\002EF\026\001\000' > "$dir/in.cmd"
+./flex2sr "$dir/in.cmd" "$dir/in.s19" || exit 1
+
+# Lists of 1 and $many files: name ext1 ext2 count
+makelist() {
+  i=0
+  : > "$dir/$1.$4"
+  while [ $i -lt $4 ]; do
+    cp "$dir/in.$2" "$dir/f$i.$2"
+    echo "$dir/f$i.$2 $dir/f$i.$3" >> "$dir/$1.$4"
+    i=$((i + 1))
+  done
+}
+
+# Allocations made by a command
+count() {
+  LD_PRELOAD=./mallocount.so MALLOCOUNT="$dir/count" "$@" > /dev/null || return 1
+  cat "$dir/count"
+}
+
+# check description listname command...
+check() {
+  desc=$1 list=$2
+  shift 2
+  one=$(count "$@" "$dir/$list.1") || { echo "FAIL $desc: command failed"; result=1; return; }
+  lots=$(count "$@" "$dir/$list.$many") || { echo "FAIL $desc: command failed"; result=1; return; }
+  if [ "$one" = "$lots" ]; then
+    echo "ok   $desc: $one allocations for 1 and $many files"
+  else
+    echo "FAIL $desc: $one allocations for 1 file, $lots for $many"
+    result=1
+  fi
+}
+
+for n in 1 $many; do
+  makelist tosr cmd s19 $n
+  makelist toflex s19 cmd $n
+done
+check "flex2sr -l" tosr ./flex2sr -l
+check "sr2flex -l" toflex ./sr2flex -l
+check "sr2flex -m -l" toflex ./sr2flex -m -l
+exit $result
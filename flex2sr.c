@@ -2,7 +2,7 @@
  * @file flex2sr.c
  * @brief FLEX binary to Motorola S-record converter
  * @details
- *   Usage: flex2sr infile outfile
+ *   See ./flex2sr -h for usage
  *   It is recommended that the output be put through srec_cat(1)
  *   or similar before further use, as this program generates records
  *   as long as those in the input file.
@@ -14,9 +14,39 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "flexbin.h"
+
+#define MAXROMS 16
+
+/**
+ * @struct rom
+ * @brief A ROM device image, covering one address window.
+ */
+struct rom {
+  unsigned int base;    ///< First address covered
+  unsigned int size;    ///< Size of device in bytes
+  char *name;           ///< Output filename
+  unsigned char *data;  ///< Contents, initially filled
+};
+
+struct rom roms[MAXROMS];
+int nroms = 0, fill = 0xFF;
+long unrouted = 0, insize;
+
+// Streams kept open between files in a batch, and their buffers
+FILE *instream = NULL, *outstream = NULL;
+char inbuf[BUFSIZ], outbuf[BUFSIZ], line[2 * FILENAME_MAX + 2];
 
 int record(FILE *infile, FILE *outfile);
+void romput(unsigned int addr, int c);
+int romwrite(void);
 void header(FILE *outfile, const char *str);
+FILE *reopen(FILE **stream, const char *name, const char *mode, char *buf);
+int convert(char *inname, const char *outname);
+int batch(const char *listname);
+void usage(const char *cmd);
 int main(int argc, char *argv[]);
 
 /**
@@ -24,59 +54,101 @@ int main(int argc, char *argv[]);
  * @brief
  *   Processes one record from the input file to the output file.
  * @details
- *   Zeroes between records are skipped over.
+ *   Records are read by binrecord(), which skips zeroes between them.
  *   Unrecognised record type identifiers are returned and not processed further.
+ *   Data bytes are also routed to any ROM images covering their addresses.
  * @param infile Open file pointer to the input FLEX binary.
- * @param outfile Open file pointer to the output S-record file.
+ * @param outfile Open file pointer to the output S-record file, or NULL for none.
  * @return
  *   The record type processed.
  *   Most likely 0x02 or 0x16.
  *   EOF if encountered.
+ *   BIN_TRUNCATED if the input ends part way through a record.
  *   Something else if an unrecognised record type.
  */
 int record(FILE *infile, FILE *outfile)
 {
-  int rectype, nbytes, c;
+  static struct binrec rec;
+  int rectype, i;
   unsigned int chksum, loadaddr;
 
-  // Skip over zeroes between records (files may have trailing zeroes).
-  // Return now if EOF or unrecognised record type.
-  do { rectype = fgetc(infile); } while (rectype == 0x00);
-  if (rectype != 0x02 && rectype != 0x16) return rectype;
+  rectype = binrecord(infile, &rec);
+  if (rectype != BIN_DATA && rectype != BIN_TRANSFER) return rectype;
 
-  // Retrieve record's load address and begin the record's checksum with it.
-  c = fgetc(infile);
-  chksum = c;
-  loadaddr = c << 8;
-  c = fgetc(infile);
-  chksum += c;
-  loadaddr |= c;
+  // Begin the record's checksum with the load address
+  loadaddr = rec.addr;
+  chksum = (loadaddr >> 8) + (loadaddr & 0xFF);
 
   switch (rectype) {
-    case 0x02: // Binary data
+    case BIN_DATA: // Binary data
       // S-record type, count and address
-      nbytes = fgetc(infile);
-      chksum += nbytes + 3;
-      fprintf(outfile, "S1%02X%04X", nbytes + 3, loadaddr);
+      chksum += rec.len + 3;
+      if (outfile) fprintf(outfile, "S1%02X%04X", rec.len + 3, loadaddr);
       // S-record data
-      while (nbytes--) {
-        c = fgetc(infile);
-        chksum += c;
-        fprintf(outfile, "%02X", c);
+      for (i = 0; i < rec.len; i++) {
+        chksum += rec.data[i];
+        if (outfile) fprintf(outfile, "%02X", rec.data[i]);
+        romput(loadaddr++ & 0xFFFF, rec.data[i]);
       }
       break;
 
-    case 0x16: // Transfer address
+    case BIN_TRANSFER: // Transfer address
       chksum += 3;
-      fprintf(outfile, "S903%04X", loadaddr);
+      if (outfile) fprintf(outfile, "S903%04X", loadaddr);
       break;
   }
 
   // S-record checksum, end of record
-  fprintf(outfile, "%02X\n", ~chksum & 0xFF);
+  if (outfile) fprintf(outfile, "%02X\n", ~chksum & 0xFF);
   return rectype;
 }
 
+/**
+ * @fn void romput(unsigned int addr, int c)
+ * @brief Stores a data byte in each ROM image whose window covers its address.
+ * @details Bytes not covered by any ROM are counted, if there are any ROMs.
+ * @param addr Load address of the byte.
+ * @param c The byte.
+ */
+void romput(unsigned int addr, int c)
+{
+  int i, routed = 0;
+
+  for (i = 0; i < nroms; i++) {
+    if (addr - roms[i].base < roms[i].size) {
+      roms[i].data[addr - roms[i].base] = c;
+      routed = 1;
+    }
+  }
+  if (nroms && !routed) unrouted++;
+}
+
+/**
+ * @fn int romwrite(void)
+ * @brief Writes out all ROM images.
+ * @return Zero on success, non-zero on error.
+ */
+int romwrite(void)
+{
+  FILE *f;
+  int i, result = 0;
+
+  for (i = 0; i < nroms; i++) {
+    f = fopen(roms[i].name, "wb");
+    if (f == NULL) {
+      fprintf(stderr, "Error opening file %s for output.\n", roms[i].name);
+      result = 1;
+      continue;
+    }
+    if (fwrite(roms[i].data, roms[i].size, 1, f) != 1) {
+      fprintf(stderr, "Error writing file %s.\n", roms[i].name);
+      result = 1;
+    }
+    if (fclose(f)) result = 1;
+  }
+  return result;
+}
+
 /**
  * @fn void header(FILE *outfile, const char *str)
  * @brief Outputs a header (S0) record
@@ -97,60 +169,205 @@ void header(FILE *outfile, const char *str)
 }
 
 /**
- * @fn int main(int argc, char *argv[])
- * @brief Main function
- * @details Open/close files and go through records until EOF or error
- * @param argc Command-line argument count
- * @param argv Command-line arguments
- * @return Zero on success, non-zero on error
+ * @fn FILE *reopen(FILE **stream, const char *name, const char *mode, char *buf)
+ * @brief Opens a file, reusing a stream from a previous file if there is one.
+ * @details
+ *   The stream is given a static buffer, so after the first file
+ *   in a batch, opening further files does not allocate memory.
+ * @param stream Stream to reuse, or NULL. Updated with the stream opened.
+ * @param name Filename.
+ * @param mode fopen(3) mode.
+ * @param buf Buffer of BUFSIZ bytes for the stream.
+ * @return The stream, or NULL on error.
  */
-int main(int argc, char *argv[])
+FILE *reopen(FILE **stream, const char *name, const char *mode, char *buf)
 {
-  FILE *infile, *outfile;
-  int rectype = 0, addrrecs = 0, datarecs = 0;
+  *stream = (*stream == NULL) ? fopen(name, mode) : freopen(name, mode, *stream);
+  if (*stream != NULL) setvbuf(*stream, buf, _IOFBF, BUFSIZ);
+  return *stream;
+}
 
-  if (argc != 3) {
-    fprintf(stderr, "\
-FLEX binary to Motorola S-record converter\n\
-Usage: %s infile outfile\n\
-It is recommended that the output be put through srec_cat(1)\n\
-or similar before further use, as this program generates records\n\
-as long as those in the input file.\n\
-", argv[0]);
-    return EXIT_FAILURE;
-  }
+/**
+ * @fn int convert(char *inname, const char *outname)
+ * @brief Converts one file, going through records until EOF or error.
+ * @details The size of the input file is left in insize, or -1 if not opened.
+ * @param inname Input filename.
+ * @param outname Output filename, or NULL if only writing ROM images.
+ * @return EOF on success, otherwise the unrecognised record type, BIN_TRUNCATED, or zero.
+ */
+int convert(char *inname, const char *outname)
+{
+  FILE *infile, *outfile = NULL;
+  int rectype = 0, addrrecs = 0, datarecs = 0;
+  struct stat st;
 
   // Open files for input and output
-  infile = fopen(argv[1], "rb");
-  outfile = fopen(argv[2], "wt");
+  insize = -1;
+  infile = reopen(&instream, inname, "rb", inbuf);
+  if (outname) outfile = reopen(&outstream, outname, "wt", outbuf);
+  if (infile != NULL && fstat(fileno(infile), &st) == 0) insize = st.st_size;
   if (infile == NULL) {
-    fprintf(stderr, "Error opening file %s for input.\n", argv[1]);
-  } else if (outfile == NULL) {
-    fprintf(stderr, "Error opening file %s for output.\n", argv[2]);
+    fprintf(stderr, "Error opening file %s for input.\n", inname);
+  } else if (outname && outfile == NULL) {
+    fprintf(stderr, "Error opening file %s for output.\n", outname);
 
   } else {
     // Output header record containing input filename
-    header(outfile, basename(argv[1]));
+    if (outfile) header(outfile, basename(inname));
 
     // Loop processing records until EOF or error
     do {
       rectype = record(infile, outfile);
-      if (rectype == 0x02) datarecs++;
-      if (rectype == 0x16) addrrecs++;
-    } while (rectype == 0x02 || rectype == 0x16);
+      if (rectype == BIN_DATA) datarecs++;
+      if (rectype == BIN_TRANSFER) addrrecs++;
+    } while (rectype == BIN_DATA || rectype == BIN_TRANSFER);
 
-    if (rectype == EOF) {
+    if (rectype == EOF && outfile) {
       // Output data record count
       fprintf(outfile, "S503%04X%02X\n", datarecs, ~(0x03 + ((datarecs >> 8) & 0xFF) + (datarecs & 0xFF)) & 0xFF);
       // Output null start address, if no start address record yet
       if (addrrecs == 0) fprintf(outfile, "S9030000FC\n");
+      if (fflush(outfile)) {
+        fprintf(stderr, "Error writing file %s.\n", outname);
+        rectype = 0;
+      }
+    } else if (rectype == BIN_TRUNCATED) {
+      fprintf(stderr, "Truncated record at end of input file %s.\n", inname);
+    } else if (rectype != EOF) {
+      fprintf(stderr, "Unrecognised record type %02X at offset %04X in input file %s.\n", rectype, (int) ftell(infile) - 1, inname);
+    }
+
+    // Write all ROM images once the whole input has been read
+    if (rectype == EOF && nroms) {
+      if (unrouted) fprintf(stderr, "Warning: %ld bytes outside all ROM windows.\n", unrouted);
+      if (romwrite()) rectype = 0;
+    }
+  }
+  return rectype;
+}
+
+/**
+ * @fn int batch(const char *listname)
+ * @brief Converts each pair of files in a list.
+ * @details
+ *   Each line of the list holds an input and an output filename,
+ *   separated by whitespace. Blank lines and lines starting with #
+ *   are skipped. A result line is output for each file:
+ *   OK or ERR, the input size in bytes, the input and output filenames.
+ * @param listname List filename, or - for standard input.
+ * @return Number of files which failed to convert, or -1 if the list can't be opened.
+ */
+int batch(const char *listname)
+{
+  FILE *list;
+  char *inname, *outname;
+  int rectype, failed = 0;
+
+  list = strcmp("-", listname) ? fopen(listname, "rt") : stdin;
+  if (list == NULL) {
+    fprintf(stderr, "Error opening file %s for input.\n", listname);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), list) != NULL) {
+    inname = strtok(line, " \t\r\n");
+    if (inname == NULL || *inname == '#') continue;
+    outname = strtok(NULL, " \t\r\n");
+    if (outname == NULL) {
+      fprintf(stderr, "No output filename for %s in list.\n", inname);
+      failed++;
+      continue;
+    }
+    rectype = convert(inname, outname);
+    printf("%s %ld %s %s\n", (rectype == EOF) ? "OK" : "ERR", insize, inname, outname);
+    if (rectype != EOF) failed++;
+  }
+
+  if (list != stdin) fclose(list);
+  return failed;
+}
+
+/**
+ * @fn void usage(const char *cmd)
+ * @brief Outputs help for the command.
+ * @param cmd Name of the program file, most likely from argv[0].
+ */
+void usage(const char *cmd)
+{
+  fprintf(stderr, "\
+FLEX binary to Motorola S-record converter\n\
+Usage: %s [-r base,size,romfile]... [-f fill] [-h] infile [outfile]\n\
+       %s -l listfile\n\
+\t-r writes the bytes from base to base+size-1 (hex) to a binary ROM\n\
+\t   image, may be given up to 16 times, outfile is then optional\n\
+\t-f is the byte (hex) used where a ROM image has no data, default FF\n\
+\t-l converts each \"infile outfile\" pair listed, one per line,\n\
+\t   outputting OK or ERR, input size and filenames for each\n\
+\t-h prints this message\n\
+It is recommended that the output be put through srec_cat(1)\n\
+or similar before further use, as this program generates records\n\
+as long as those in the input file.\n\
+", cmd, cmd);
+  exit(EXIT_FAILURE);
+}
 
-    } else {
-      fprintf(stderr, "Unrecognised record type %02X at offset %04X in input file.\n", rectype, (int) ftell(infile) - 1);
+/**
+ * @fn int main(int argc, char *argv[])
+ * @brief Main function
+ * @details Parse options, then convert one file or a list of files
+ * @param argc Command-line argument count
+ * @param argv Command-line arguments
+ * @return Zero on success, non-zero on error
+ */
+int main(int argc, char *argv[])
+{
+  int opt, n, i, result;
+  char *end, *listname = NULL;
+
+  while ((opt = getopt(argc, argv, "r:f:l:h")) != -1) {
+    switch (opt) {
+      case 'r': // ROM window
+        if (nroms == MAXROMS) usage(argv[0]);
+        n = 0;
+        sscanf(optarg, "%x,%x,%n", &roms[nroms].base, &roms[nroms].size, &n);
+        if (n == 0 || optarg[n] == '\0' || roms[nroms].size == 0 ||
+            roms[nroms].base > 0xFFFF || roms[nroms].size > 0x10000 - roms[nroms].base) usage(argv[0]);
+        roms[nroms].name = optarg + n;
+        roms[nroms].data = malloc(roms[nroms].size);
+        if (roms[nroms].data == NULL) {
+          fprintf(stderr, "Out of memory.\n");
+          return EXIT_FAILURE;
+        }
+        nroms++;
+        break;
+      case 'f': // Fill byte
+        fill = strtol(optarg, &end, 16);
+        if (*optarg == '\0' || *end != '\0' || fill < 0 || fill > 0xFF) usage(argv[0]);
+        break;
+
+      case 'l': // Batch list
+        listname = optarg;
+        break;
+
+      case 'h': // Help/usage
+      case '?':
+      default:
+        usage(argv[0]);
     }
   }
+  if (listname) {
+    // Batch of files, not combined with ROM images
+    if (nroms || argc != optind) usage(argv[0]);
+    result = batch(listname) ? EXIT_FAILURE : EXIT_SUCCESS;
+
+  } else {
+    if (argc - optind != 2 && !(nroms && argc - optind == 1)) usage(argv[0]);
+    for (i = 0; i < nroms; i++) memset(roms[i].data, fill, roms[i].size);
+    result = (convert(argv[optind], (argc - optind == 2) ? argv[optind + 1] : NULL) == EOF) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
 
-  if (infile != NULL) fclose(infile);
-  if (outfile != NULL) fclose(outfile);
-  return (rectype == EOF) ? EXIT_SUCCESS : EXIT_FAILURE;
+  if (instream != NULL) fclose(instream);
+  if (outstream != NULL) fclose(outstream);
+  for (i = 0; i < nroms; i++) free(roms[i].data);
+  return result;
 }
@@ -0,0 +1,52 @@
+/**
+ * @file flexbin.c
+ * @brief FLEX binary record reader
+ * @details
+ *   A data record is 0x02, a 16-bit load address, a count and that many
+ *   bytes. A transfer address record is 0x16 and a 16-bit address.
+ *   Files may be padded with zeroes between and after records.
+ * @author David Knoll <david@davidknoll.me.uk>
+ * @copyright MIT License
+ */
+#include <stdio.h>
+#include "flexbin.h"
+
+/**
+ * @fn int binrecord(FILE *infile, struct binrec *rec)
+ * @brief Reads one record from a FLEX binary.
+ * @details
+ *   Zeroes between records are skipped over.
+ *   Unrecognised record type identifiers are returned and not processed further.
+ * @param infile Open file pointer to the input FLEX binary.
+ * @param rec The record read.
+ * @return
+ *   The record type read, BIN_DATA or BIN_TRANSFER.
+ *   EOF if at the end of the file.
+ *   BIN_TRUNCATED if the file ends part way through a record.
+ *   Something else if an unrecognised record type.
+ */
+int binrecord(FILE *infile, struct binrec *rec)
+{
+  int rectype, hi, lo, c, i;
+
+  // Skip over zeroes between records (files may have trailing zeroes).
+  // Return now if EOF or unrecognised record type.
+  do { rectype = fgetc(infile); } while (rectype == 0x00);
+  if (rectype != BIN_DATA && rectype != BIN_TRANSFER) return rectype;
+
+  hi = fgetc(infile);
+  lo = fgetc(infile);
+  if (lo == EOF) return BIN_TRUNCATED;
+  rec->addr = (hi << 8) | lo;
+  rec->len = 0;
+
+  if (rectype == BIN_DATA) {
+    rec->len = fgetc(infile);
+    if (rec->len == EOF) return BIN_TRUNCATED;
+    for (i = 0; i < rec->len; i++) {
+      if ((c = fgetc(infile)) == EOF) return BIN_TRUNCATED;
+      rec->data[i] = c;
+    }
+  }
+  return rectype;
+}
@@ -0,0 +1,34 @@
+/**
+ * @file flexbin.h
+ * @brief FLEX binary record reader
+ * @details
+ *   Reads the records of a FLEX binary (.CMD) file one at a time,
+ *   shared by the tools that convert or inspect binaries.
+ * @author David Knoll <david@davidknoll.me.uk>
+ * @copyright MIT License
+ */
+#ifndef FLEXBIN_H
+#define FLEXBIN_H
+
+#include <stdio.h>
+
+// Record type identifiers
+#define BIN_DATA      0x02
+#define BIN_TRANSFER  0x16
+
+// Returned by binrecord() if the file ends part way through a record
+#define BIN_TRUNCATED (-2)
+
+/**
+ * @struct binrec
+ * @brief One record from a FLEX binary.
+ */
+struct binrec {
+  unsigned int addr;          ///< Load address, or transfer address
+  int len;                    ///< Number of data bytes, zero for a transfer address
+  unsigned char data[255];    ///< Data bytes
+};
+
+int binrecord(FILE *infile, struct binrec *rec);
+
+#endif
@@ -0,0 +1,785 @@
+/**
+ * @file flexdisk.c
+ * @brief FLEX disk image access
+ * @details
+ *   Images are a flat sequence of 256-byte sectors, track by track,
+ *   with sectors numbered from 1, as output by mkflexfs.
+ *   The geometry is taken from the max track/sector fields of the SIR.
+ *   Images on devices with larger physical blocks, such as CF cards,
+ *   may pack sectors into blocks as described by a struct blockmap.
+ *   These are accessed a whole block at a time through a one-block
+ *   buffer, so the device never sees a partial block write.
+ *   Images being built from scratch may be held in memory, and saved
+ *   to a file in one go.
+ * @author David Knoll <david@davidknoll.me.uk>
+ * @copyright MIT License
+ */
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "flexdisk.h"
+
+static void setfree(struct flexdisk *d, int strk, int ssec, int etrk, int esec, int count);
+
+/**
+ * @fn int parseblocks(const char *arg, struct blockmap *map)
+ * @brief Parses a block layout option.
+ * @details
+ *   The format is size[,perblock][,t], size being the physical block
+ *   size in bytes, a multiple of 256. perblock defaults to as many
+ *   sectors as fit in a block, t starts each track on a new block.
+ * @param arg Option argument, such as 512 or 512,1,t
+ * @param map Block layout to fill in.
+ * @return Zero on success, -1 if not valid.
+ */
+int parseblocks(const char *arg, struct blockmap *map)
+{
+  char *end;
+
+  map->size = strtol(arg, &end, 10);
+  if (map->size < SECSIZE || map->size > 16 * SECSIZE || map->size % SECSIZE) return -1;
+  map->perblock = map->size / SECSIZE;
+  map->align = 0;
+  if (*end == ',' && isdigit((unsigned char) end[1])) {
+    map->perblock = strtol(end + 1, &end, 10);
+    if (map->perblock < 1 || map->perblock > map->size / SECSIZE) return -1;
+  }
+  if (*end == ',' && end[1] == 't') {
+    map->align = 1;
+    end += 2;
+  }
+  return (*end == '\0') ? 0 : -1;
+}
+
+/**
+ * @fn long slotoffset(const struct blockmap *map, long slot)
+ * @brief Finds the offset of a sector slot within the device.
+ * @param map Block layout.
+ * @param slot Sector slot, counting from zero at the start of the device.
+ * @return Byte offset of the slot.
+ */
+long slotoffset(const struct blockmap *map, long slot)
+{
+  return slot / map->perblock * map->size + slot % map->perblock * SECSIZE;
+}
+
+/**
+ * @fn int flushblock(struct flexdisk *d)
+ * @brief Writes back the current physical block, if it has been modified.
+ * @param d Open disk.
+ * @return Zero on success, -1 on error.
+ */
+static int flushblock(struct flexdisk *d)
+{
+  if (!d->dirty) return 0;
+  if (fseek(d->f, d->blockno * d->map.size, SEEK_SET) ||
+      fwrite(d->block, d->map.size, 1, d->f) != 1) return -1;
+  d->dirty = 0;
+  return 0;
+}
+
+/**
+ * @fn int loadblock(struct flexdisk *d, long blockno)
+ * @brief Makes a physical block the current one, writing back the previous one.
+ * @param d Open disk.
+ * @param blockno Block number.
+ * @return Zero on success, -1 on error.
+ */
+static int loadblock(struct flexdisk *d, long blockno)
+{
+  if (blockno == d->blockno) return 0;
+  if (flushblock(d)) return -1;
+  d->blockno = -1;
+  if (fseek(d->f, blockno * d->map.size, SEEK_SET) ||
+      fread(d->block, d->map.size, 1, d->f) != 1) return -1;
+  d->blockno = blockno;
+  return 0;
+}
+
+/**
+ * @fn int diskopen(struct flexdisk *d, const char *name, const char *mode, const struct blockmap *map)
+ * @brief Opens a disk image and reads its geometry from the SIR.
+ * @param d Disk structure to fill in.
+ * @param name Image filename.
+ * @param mode fopen(3) mode, "rb" or "r+b".
+ * @param map Physical block layout, or NULL for a plain image.
+ * @return Zero on success, -1 on error (file is closed again).
+ */
+int diskopen(struct flexdisk *d, const char *name, const char *mode, const struct blockmap *map)
+{
+  d->mem = NULL;
+  d->block = NULL;
+  d->blockno = -1;
+  d->dirty = 0;
+  d->map.size = SECSIZE;
+  d->map.perblock = 1;
+  d->map.align = 0;
+  if (map != NULL) d->map = *map;
+  if (d->map.size > SECSIZE && (d->block = malloc(d->map.size)) == NULL) return -1;
+
+  d->f = fopen(name, mode);
+  if (d->f == NULL) {
+    free(d->block);
+    return -1;
+  }
+  if (d->block != NULL) setvbuf(d->f, NULL, _IOFBF, d->map.size);
+
+  // The SIR is always the third sector, whatever the geometry
+  d->tracks = 1;
+  d->sectors = SIR_SECTOR;
+  if (diskread(d, SIR_TRACK, SIR_SECTOR, d->sir)) {
+    diskclose(d);
+    return -1;
+  }
+  d->tracks = d->sir[SIR_MAXTRACK] + 1;
+  d->sectors = d->sir[SIR_MAXSECTOR];
+  if (d->tracks < 2 || d->sectors < 5) {
+    diskclose(d);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @fn void formatsector(const struct flexdisk *d, int trk, int sec, unsigned char *buf)
+ * @brief Fills in a blank sector with a link to the next in its chain.
+ * @details
+ *   This is the layout of a blank disk, as mkflexfs creates.
+ *   Track 0 holds the boot sectors, SIR and directory chain,
+ *   every other sector is linked into one free chain.
+ *   The SIR itself is left blank, see formatsir().
+ * @param d Disk, with geometry set.
+ * @param trk Track number.
+ * @param sec Sector number.
+ * @param buf Buffer of SECSIZE bytes.
+ */
+void formatsector(const struct flexdisk *d, int trk, int sec, unsigned char *buf)
+{
+  memset(buf, 0, SECSIZE);
+  if (trk == 0 && sec >= DIR_SECTOR && sec < d->sectors) {
+    // Directory chain
+    buf[0] = trk;
+    buf[1] = sec + 1;
+  } else if (trk == 0 || (trk == d->tracks - 1 && sec == d->sectors)) {
+    // Boot sector, SIR, reserved, or end of directory or free chain
+  } else if (sec == d->sectors) {
+    // End of track
+    buf[0] = trk + 1;
+    buf[1] = 1;
+  } else {
+    // Free chain
+    buf[0] = trk;
+    buf[1] = sec + 1;
+  }
+}
+
+/**
+ * @fn void formatsir(struct flexdisk *d, const char *volname, int volnum)
+ * @brief Fills in the cached SIR for a blank disk.
+ * @details
+ *   The free chain runs from track 1 sector 1 to the last sector, and
+ *   the initialisation date is taken from the system date.
+ * @param d Disk, with geometry set.
+ * @param volname Volume name, max 11 characters.
+ * @param volnum Volume number.
+ */
+void formatsir(struct flexdisk *d, const char *volname, int volnum)
+{
+  time_t rawtime;
+  struct tm timeinfo;
+
+  memset(d->sir, 0, SECSIZE);
+  memcpy(d->sir + SIR_VOLNAME, volname, strlen(volname));
+  d->sir[SIR_VOLNUM] = volnum >> 8;
+  d->sir[SIR_VOLNUM + 1] = volnum;
+  setfree(d, 1, 1, d->tracks - 1, d->sectors, (d->tracks - 1) * d->sectors);
+  time(&rawtime);
+  localtime_r(&rawtime, &timeinfo);
+  d->sir[SIR_DATE] = timeinfo.tm_mon + 1;
+  d->sir[SIR_DATE + 1] = timeinfo.tm_mday;
+  d->sir[SIR_DATE + 2] = timeinfo.tm_year % 100;
+  d->sir[SIR_MAXTRACK] = d->tracks - 1;
+  d->sir[SIR_MAXSECTOR] = d->sectors;
+}
+
+/**
+ * @fn int diskcreate(struct flexdisk *d, int tracks, int sectors, const char *volname, int volnum)
+ * @brief Creates a blank disk image in memory.
+ * @details The initialisation date is taken from the system date.
+ * @param d Disk structure to fill in.
+ * @param tracks Number of tracks, min 2.
+ * @param sectors Sectors per track, min 5.
+ * @param volname Volume name, max 11 characters.
+ * @param volnum Volume number.
+ * @return Zero on success, -1 if out of memory or bad parameters.
+ */
+int diskcreate(struct flexdisk *d, int tracks, int sectors, const char *volname, int volnum)
+{
+  int trk, sec;
+
+  if (tracks < 2 || tracks > 256 || sectors < 5 || sectors > 255 || strlen(volname) > 11) return -1;
+  d->f = NULL;
+  d->block = NULL;
+  d->blockno = -1;
+  d->dirty = 0;
+  d->map.size = SECSIZE;
+  d->map.perblock = 1;
+  d->map.align = 0;
+  d->tracks = tracks;
+  d->sectors = sectors;
+  d->mem = malloc((long) tracks * sectors * SECSIZE);
+  if (d->mem == NULL) return -1;
+  for (trk = 0; trk < tracks; trk++) {
+    for (sec = 1; sec <= sectors; sec++) {
+      formatsector(d, trk, sec, d->mem + ((long) trk * sectors + sec - 1) * SECSIZE);
+    }
+  }
+
+  formatsir(d, volname, volnum);
+  return disksync(d);
+}
+
+/**
+ * @fn void putslot(FILE *f, const struct blockmap *map, long *slot, const unsigned char *buf)
+ * @brief Outputs one sector slot, padding out the block after its last slot.
+ * @param f Output stream.
+ * @param map Block layout.
+ * @param slot Number of slots output so far, updated.
+ * @param buf Sector contents.
+ */
+static void putslot(FILE *f, const struct blockmap *map, long *slot, const unsigned char *buf)
+{
+  int i;
+
+  fwrite(buf, SECSIZE, 1, f);
+  if (++*slot % map->perblock) return;
+  for (i = map->perblock * SECSIZE; i < map->size; i++) fputc(0, f);
+}
+
+/**
+ * @fn int diskput(const struct flexdisk *d, FILE *f, const struct blockmap *map)
+ * @brief Writes a disk image held in memory to an open stream, in a block layout.
+ * @details
+ *   Unused slots are output blank to finish the last block, and the
+ *   last block of each track if map->align is set. For whole block
+ *   writes to a device, give the stream a buffer of whole blocks.
+ * @param d Disk in memory.
+ * @param f Output stream.
+ * @param map Block layout, or NULL for a plain image.
+ * @return Zero on success, -1 on error.
+ */
+int diskput(const struct flexdisk *d, FILE *f, const struct blockmap *map)
+{
+  static const unsigned char blank[SECSIZE];
+  struct blockmap plain = { SECSIZE, 1, 0 };
+  long slot = 0;
+  int trk, sec;
+
+  if (map == NULL) map = &plain;
+  for (trk = 0; trk < d->tracks; trk++) {
+    for (sec = 1; sec <= d->sectors; sec++) {
+      putslot(f, map, &slot, d->mem + ((long) trk * d->sectors + sec - 1) * SECSIZE);
+    }
+    while (map->align && slot % map->perblock) putslot(f, map, &slot, blank);
+  }
+  while (slot % map->perblock) putslot(f, map, &slot, blank);
+  return ferror(f) ? -1 : 0;
+}
+
+/**
+ * @fn int disksave(const struct flexdisk *d, const char *name, const struct blockmap *map)
+ * @brief Writes a disk image held in memory to a file.
+ * @param d Disk in memory.
+ * @param name Image filename.
+ * @param map Block layout, or NULL for a plain image.
+ * @return Zero on success, -1 on error.
+ */
+int disksave(const struct flexdisk *d, const char *name, const struct blockmap *map)
+{
+  FILE *f = fopen(name, "wb");
+  int result;
+
+  if (f == NULL) return -1;
+  if (map != NULL && map->size > SECSIZE) setvbuf(f, NULL, _IOFBF, map->size * 16);
+  result = diskput(d, f, map);
+  if (fclose(f)) result = -1;
+  return result;
+}
+
+/**
+ * @fn int diskclose(struct flexdisk *d)
+ * @brief Closes a disk image, or frees one held in memory.
+ * @details Does not write back the SIR, see disksync().
+ * @param d Open disk.
+ * @return Zero on success, EOF on error.
+ */
+int diskclose(struct flexdisk *d)
+{
+  int result = 0;
+
+  if (d->f != NULL) {
+    if (flushblock(d)) result = EOF;
+    if (fclose(d->f)) result = EOF;
+  }
+  free(d->mem);
+  free(d->block);
+  d->f = NULL;
+  d->mem = NULL;
+  d->block = NULL;
+  return result;
+}
+
+/**
+ * @fn long sectoroffset(const struct flexdisk *d, int trk, int sec)
+ * @brief Finds the offset of a sector within the image, allowing for the block layout.
+ * @param d Open disk.
+ * @param trk Track number, from 0.
+ * @param sec Sector number, from 1.
+ * @return Byte offset of the sector, or -1 if out of range.
+ */
+static long sectoroffset(const struct flexdisk *d, int trk, int sec)
+{
+  long pertrack = d->sectors;
+
+  if (trk < 0 || trk >= d->tracks || sec < 1 || sec > d->sectors) return -1;
+  if (d->map.align) pertrack = (pertrack + d->map.perblock - 1) / d->map.perblock * d->map.perblock;
+  return slotoffset(&d->map, trk * pertrack + sec - 1);
+}
+
+/**
+ * @fn int diskread(struct flexdisk *d, int trk, int sec, unsigned char *buf)
+ * @brief Reads one sector.
+ * @param d Open disk.
+ * @param trk Track number.
+ * @param sec Sector number.
+ * @param buf Buffer of SECSIZE bytes.
+ * @return Zero on success, -1 on error or bad track/sector.
+ */
+int diskread(struct flexdisk *d, int trk, int sec, unsigned char *buf)
+{
+  long offset = sectoroffset(d, trk, sec);
+  if (offset < 0) return -1;
+  if (d->mem != NULL) {
+    memcpy(buf, d->mem + offset, SECSIZE);
+    return 0;
+  }
+  if (d->block != NULL) {
+    if (loadblock(d, offset / d->map.size)) return -1;
+    memcpy(buf, d->block + offset % d->map.size, SECSIZE);
+    return 0;
+  }
+  if (fseek(d->f, offset, SEEK_SET)) return -1;
+  return (fread(buf, SECSIZE, 1, d->f) == 1) ? 0 : -1;
+}
+
+/**
+ * @fn int diskwrite(struct flexdisk *d, int trk, int sec, const unsigned char *buf)
+ * @brief Writes one sector.
+ * @param d Open disk.
+ * @param trk Track number.
+ * @param sec Sector number.
+ * @param buf Buffer of SECSIZE bytes.
+ * @return Zero on success, -1 on error or bad track/sector.
+ */
+int diskwrite(struct flexdisk *d, int trk, int sec, const unsigned char *buf)
+{
+  long offset = sectoroffset(d, trk, sec);
+  if (offset < 0) return -1;
+  if (d->mem != NULL) {
+    memcpy(d->mem + offset, buf, SECSIZE);
+    return 0;
+  }
+  if (d->block != NULL) {
+    // The rest of the block is preserved, and written with it later
+    if (loadblock(d, offset / d->map.size)) return -1;
+    memcpy(d->block + offset % d->map.size, buf, SECSIZE);
+    d->dirty = 1;
+    return 0;
+  }
+  if (fseek(d->f, offset, SEEK_SET)) return -1;
+  return (fwrite(buf, SECSIZE, 1, d->f) == 1) ? 0 : -1;
+}
+
+/**
+ * @fn int disksync(struct flexdisk *d)
+ * @brief Writes the cached SIR, and any buffered block, back to the image.
+ * @param d Open disk.
+ * @return Zero on success, -1 on error.
+ */
+int disksync(struct flexdisk *d)
+{
+  if (diskwrite(d, SIR_TRACK, SIR_SECTOR, d->sir)) return -1;
+  if (d->mem != NULL) return 0;
+  if (flushblock(d)) return -1;
+  return fflush(d->f) ? -1 : 0;
+}
+
+/**
+ * @fn int freecount(const struct flexdisk *d)
+ * @brief Returns the number of sectors in the free chain, according to the SIR.
+ * @param d Open disk.
+ * @return Free sector count.
+ */
+int freecount(const struct flexdisk *d)
+{
+  return (d->sir[SIR_FREECOUNT] << 8) | d->sir[SIR_FREECOUNT + 1];
+}
+
+/**
+ * @fn void setfree(struct flexdisk *d, int strk, int ssec, int etrk, int esec, int count)
+ * @brief Updates the free chain start, end and count in the cached SIR.
+ */
+static void setfree(struct flexdisk *d, int strk, int ssec, int etrk, int esec, int count)
+{
+  if (count == 0) strk = ssec = etrk = esec = 0;
+  d->sir[SIR_FREESTART] = strk;
+  d->sir[SIR_FREESTART + 1] = ssec;
+  d->sir[SIR_FREEEND] = etrk;
+  d->sir[SIR_FREEEND + 1] = esec;
+  d->sir[SIR_FREECOUNT] = count >> 8;
+  d->sir[SIR_FREECOUNT + 1] = count;
+}
+
+/**
+ * @fn int freechain(struct flexdisk *d, int strk, int ssec, int etrk, int esec, int count)
+ * @brief Returns a chain of sectors to the end of the free chain.
+ * @details
+ *   As FLEX itself does on delete, the chain is linked on after the
+ *   current last free sector, so the free chain keeps its mkflexfs order
+ *   with released space at the end. Only the cached SIR is updated.
+ * @param d Open disk.
+ * @param strk First track of the chain being released.
+ * @param ssec First sector of the chain being released.
+ * @param etrk Last track of the chain being released.
+ * @param esec Last sector of the chain being released.
+ * @param count Number of sectors in the chain being released.
+ * @return Zero on success, -1 on error.
+ */
+int freechain(struct flexdisk *d, int strk, int ssec, int etrk, int esec, int count)
+{
+  unsigned char buf[SECSIZE];
+  int free = freecount(d);
+
+  if (count <= 0) return 0;
+  if (free == 0) {
+    setfree(d, strk, ssec, etrk, esec, count);
+    return 0;
+  }
+
+  // Link the current end of the free chain to the released chain
+  if (diskread(d, d->sir[SIR_FREEEND], d->sir[SIR_FREEEND + 1], buf)) return -1;
+  buf[0] = strk;
+  buf[1] = ssec;
+  if (diskwrite(d, d->sir[SIR_FREEEND], d->sir[SIR_FREEEND + 1], buf)) return -1;
+  setfree(d, d->sir[SIR_FREESTART], d->sir[SIR_FREESTART + 1], etrk, esec, free + count);
+  return 0;
+}
+
+/**
+ * @fn int diskgrow(struct flexdisk *d, int tracks)
+ * @brief Adds tracks to the end of a disk image, and their sectors to the free chain.
+ * @details
+ *   The file is extended, only the new sectors are written, laid out
+ *   as mkflexfs would, and the new chain is linked on after the current
+ *   last free sector. The max track and free chain fields of the cached
+ *   SIR are updated, the caller writes it back with disksync().
+ * @param d Disk opened for update.
+ * @param tracks New number of tracks, up to 256.
+ * @return Zero on success, -1 on error or if the free count would overflow.
+ */
+int diskgrow(struct flexdisk *d, int tracks)
+{
+  unsigned char buf[SECSIZE];
+  int oldtracks = d->tracks, free = freecount(d), added, trk, sec;
+  long size, oldsize;
+
+  added = (tracks - oldtracks) * d->sectors;
+  if (d->f == NULL || tracks <= oldtracks || tracks > 256 || free + added > 0xFFFF) return -1;
+
+  // Extend the file to hold the new tracks, rounded up to a whole block
+  d->tracks = tracks;
+  size = sectoroffset(d, tracks - 1, d->sectors) + SECSIZE;
+  size = (size + d->map.size - 1) / d->map.size * d->map.size;
+  if (flushblock(d) || fseek(d->f, 0, SEEK_END) || (oldsize = ftell(d->f)) < 0 ||
+      (size > oldsize && (fflush(d->f) || ftruncate(fileno(d->f), size)))) {
+    d->tracks = oldtracks;
+    return -1;
+  }
+
+  // New free chain, then link it on
+  for (trk = oldtracks; trk < tracks; trk++) {
+    for (sec = 1; sec <= d->sectors; sec++) {
+      formatsector(d, trk, sec, buf);
+      if (diskwrite(d, trk, sec, buf)) return -1;
+    }
+  }
+  if (freechain(d, oldtracks, 1, tracks - 1, d->sectors, added)) return -1;
+  d->sir[SIR_MAXTRACK] = tracks - 1;
+  return 0;
+}
+
+/**
+ * @fn int freepop(struct flexdisk *d, int *trk, int *sec)
+ * @brief Takes the first sector off the free chain.
+ * @param d Open disk.
+ * @param trk Set to the track of the sector taken.
+ * @param sec Set to the sector number of the sector taken.
+ * @return Zero on success, -1 if the disk is full or on error.
+ */
+static int freepop(struct flexdisk *d, int *trk, int *sec)
+{
+  unsigned char buf[SECSIZE];
+  int free = freecount(d);
+
+  if (free == 0) return -1;
+  *trk = d->sir[SIR_FREESTART];
+  *sec = d->sir[SIR_FREESTART + 1];
+  if (diskread(d, *trk, *sec, buf)) return -1;
+  setfree(d, buf[0], buf[1], d->sir[SIR_FREEEND], d->sir[SIR_FREEEND + 1], free - 1);
+  return 0;
+}
+
+/**
+ * @fn int writefile(struct flexdisk *d, const unsigned char *data, long len, unsigned char *ent)
+ * @brief Writes file contents into sectors taken from the start of the free chain.
+ * @details
+ *   The sectors keep the links they already had in the free chain,
+ *   so each is read once and written once. An empty file still takes
+ *   one sector. The start, end and size fields of the directory entry
+ *   are filled in; the name, attributes and date are left to the caller,
+ *   as is writing the entry and the SIR back to the disk.
+ * @param d Open disk.
+ * @param data File contents.
+ * @param len Length of file contents in bytes.
+ * @param ent Directory entry to fill in.
+ * @return Zero on success, -1 if the disk is full or on error.
+ */
+int writefile(struct flexdisk *d, const unsigned char *data, long len, unsigned char *ent)
+{
+  unsigned char buf[SECSIZE];
+  int count = (len + DATASIZE - 1) / DATASIZE, free = freecount(d);
+  int trk, sec, i;
+  long n;
+
+  if (count == 0) count = 1;
+  if (count > free) return -1;
+
+  trk = d->sir[SIR_FREESTART];
+  sec = d->sir[SIR_FREESTART + 1];
+  ent[ENT_START] = trk;
+  ent[ENT_START + 1] = sec;
+
+  for (i = 1; i <= count; i++) {
+    if (diskread(d, trk, sec, buf)) return -1;
+    if (i == count) {
+      // New start of the free chain, and end of the file
+      setfree(d, buf[0], buf[1], d->sir[SIR_FREEEND], d->sir[SIR_FREEEND + 1], free - count);
+      buf[0] = buf[1] = 0;
+    }
+    buf[2] = i >> 8;
+    buf[3] = i;
+    n = (len > DATASIZE) ? DATASIZE : len;
+    memcpy(buf + 4, data, n);
+    memset(buf + 4 + n, 0, DATASIZE - n);
+    data += n;
+    len -= n;
+    if (diskwrite(d, trk, sec, buf)) return -1;
+    if (i == count) break;
+    trk = buf[0];
+    sec = buf[1];
+  }
+
+  ent[ENT_END] = trk;
+  ent[ENT_END + 1] = sec;
+  ent[ENT_SIZE] = count >> 8;
+  ent[ENT_SIZE + 1] = count;
+  return 0;
+}
+
+/**
+ * @fn int dirnext(struct flexdisk *d, int *trk, int *sec, int *idx, unsigned char *buf)
+ * @brief Steps through directory entry slots, used or not.
+ * @details
+ *   Set *idx to -1 before the first call. On return, the entry is at
+ *   buf + DIR_FIRST + *idx * DIR_ENTSIZE and buf holds the whole
+ *   directory sector at *trk, *sec, ready to be modified and written back.
+ *   A directory chain longer than the disk must loop, and is an error.
+ * @param d Open disk.
+ * @param trk Track of the current directory sector.
+ * @param sec Sector number of the current directory sector.
+ * @param idx Index of the entry within the current directory sector.
+ * @param buf Buffer of SECSIZE bytes holding the current directory sector.
+ * @return 1 if there is an entry, 0 at the end of the directory chain, -1 on error.
+ */
+int dirnext(struct flexdisk *d, int *trk, int *sec, int *idx, unsigned char *buf)
+{
+  if (*idx < 0) {
+    *trk = DIR_TRACK;
+    *sec = DIR_SECTOR;
+    d->dirsecs = 1;
+    if (diskread(d, *trk, *sec, buf)) return -1;
+  } else if (*idx + 1 >= DIR_ENTRIES) {
+    if (buf[0] == 0 && buf[1] == 0) return 0;
+    if (++d->dirsecs > (long) d->tracks * d->sectors) return -1;
+    *trk = buf[0];
+    *sec = buf[1];
+    *idx = -1;
+    if (diskread(d, *trk, *sec, buf)) return -1;
+  }
+  (*idx)++;
+  return 1;
+}
+
+/**
+ * @fn int dirfind(struct flexdisk *d, const char *name, int *trk, int *sec, int *idx, unsigned char *buf)
+ * @brief Finds a file in the directory.
+ * @param d Open disk.
+ * @param name 11-byte name and extension, as from flexname().
+ * @param trk Set to the track of the directory sector containing the entry.
+ * @param sec Set to the sector number of the directory sector containing the entry.
+ * @param idx Set to the index of the entry within the directory sector.
+ * @param buf Buffer of SECSIZE bytes, receives the directory sector.
+ * @return 1 if found, 0 if not, -1 on error.
+ */
+int dirfind(struct flexdisk *d, const char *name, int *trk, int *sec, int *idx, unsigned char *buf)
+{
+  int result;
+  unsigned char *ent;
+
+  *idx = -1;
+  while ((result = dirnext(d, trk, sec, idx, buf)) == 1) {
+    ent = buf + DIR_FIRST + *idx * DIR_ENTSIZE;
+    // A never-used entry marks the end of the directory
+    if (ent[ENT_NAME] == 0) return 0;
+    if (!memcmp(ent, name, 11)) return 1;
+  }
+  return result;
+}
+
+/**
+ * @fn int dirslot(struct flexdisk *d, int *trk, int *sec, int *idx, unsigned char *buf)
+ * @brief Finds a deleted or never-used directory entry.
+ * @details
+ *   If the directory is full, it is extended by a sector taken from the
+ *   free chain, as FLEX does. The cached SIR may be modified.
+ * @param d Open disk.
+ * @param trk Set to the track of the directory sector containing the slot.
+ * @param sec Set to the sector number of the directory sector containing the slot.
+ * @param idx Set to the index of the slot within the directory sector.
+ * @param buf Buffer of SECSIZE bytes, receives the directory sector.
+ * @return Zero on success, -1 if the disk is full or on error.
+ */
+int dirslot(struct flexdisk *d, int *trk, int *sec, int *idx, unsigned char *buf)
+{
+  int result, ntrk, nsec;
+  unsigned char *ent;
+
+  *idx = -1;
+  while ((result = dirnext(d, trk, sec, idx, buf)) == 1) {
+    ent = buf + DIR_FIRST + *idx * DIR_ENTSIZE;
+    if (ent[ENT_NAME] == 0 || (ent[ENT_NAME] & 0x80)) return 0;
+  }
+  if (result < 0) return -1;
+
+  // Directory full, link a new sector onto the end of it
+  if (freepop(d, &ntrk, &nsec)) return -1;
+  buf[0] = ntrk;
+  buf[1] = nsec;
+  if (diskwrite(d, *trk, *sec, buf)) return -1;
+  memset(buf, 0, SECSIZE);
+  *trk = ntrk;
+  *sec = nsec;
+  *idx = 0;
+  return diskwrite(d, *trk, *sec, buf);
+}
+
+/**
+ * @fn int flexname(const char *host, char *name)
+ * @brief Converts a host filename to a FLEX directory name and extension.
+ * @details
+ *   The name must start with a letter and have up to 8 characters,
+ *   the extension up to 3. Letters, digits, - and _ are accepted.
+ *   The result is upper case and padded with zeroes, as in the directory.
+ * @param host Host filename, without any directory part.
+ * @param name Buffer of 11 bytes to receive the name and extension.
+ * @return Zero on success, -1 if not a valid FLEX filename.
+ */
+int flexname(const char *host, char *name)
+{
+  int i = 0, max = 8;
+
+  memset(name, 0, 11);
+  if (!isalpha((unsigned char) *host)) return -1;
+  for (; *host; host++) {
+    if (*host == '.' && max == 8) {
+      i = 8;
+      max = 11;
+    } else if ((isalnum((unsigned char) *host) || *host == '-' || *host == '_') && i < max) {
+      name[i++] = toupper((unsigned char) *host);
+    } else {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @fn void namestr(const unsigned char *ent, char *str)
+ * @brief Converts the name and extension in a directory entry to a string.
+ * @param ent Directory entry.
+ * @param str Buffer of at least 13 bytes, receives NAME.EXT
+ */
+void namestr(const unsigned char *ent, char *str)
+{
+  int i;
+
+  for (i = 0; i < 8 && ent[ENT_NAME + i]; i++) *str++ = ent[ENT_NAME + i] & 0x7F;
+  if (ent[ENT_EXT]) *str++ = '.';
+  for (i = 0; i < 3 && ent[ENT_EXT + i]; i++) *str++ = ent[ENT_EXT + i];
+  *str = '\0';
+}
+
+/**
+ * @fn unsigned long long fnvhash(const unsigned char *data, long len, unsigned long long h)
+ * @brief Hashes data (64-bit FNV-1a), continuing from an earlier hash.
+ * @param data Data to hash.
+ * @param len Length of data in bytes.
+ * @param h Hash so far, FNV_INIT to start.
+ * @return Hash value.
+ */
+unsigned long long fnvhash(const unsigned char *data, long len, unsigned long long h)
+{
+  while (len--) {
+    h ^= *data++;
+    h *= 0x100000001B3ULL;
+  }
+  return h;
+}
+
+/**
+ * @fn int hashfile(const char *name, unsigned long long *hash)
+ * @brief Hashes a file's contents (64-bit FNV-1a). Safe to call from several threads.
+ * @param name Filename.
+ * @param hash Set to the hash value.
+ * @return Zero on success, -1 on error.
+ */
+int hashfile(const char *name, unsigned long long *hash)
+{
+  static __thread unsigned char buf[0x10000];
+  unsigned long long h = FNV_INIT;
+  size_t n;
+  FILE *f;
+
+  f = fopen(name, "rb");
+  if (f == NULL) return -1;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) h = fnvhash(buf, n, h);
+  if (ferror(f)) {
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+  *hash = h;
+  return 0;
+}
@@ -0,0 +1,112 @@
+/**
+ * @file flexdisk.h
+ * @brief FLEX disk image access
+ * @details
+ *   Sector-level access to FLEX disk images as created by mkflexfs,
+ *   either in a file or held in memory, plus directory and free chain
+ *   handling and content hashing shared by the image tools.
+ * @author David Knoll <david@davidknoll.me.uk>
+ * @copyright MIT License
+ */
+#ifndef FLEXDISK_H
+#define FLEXDISK_H
+
+#include <stdio.h>
+
+// Sector size, and data bytes per file sector after link and sequence number
+#define SECSIZE  256
+#define DATASIZE 252
+
+// System Information Record location and field offsets
+#define SIR_TRACK      0
+#define SIR_SECTOR     3
+#define SIR_VOLNAME    0x10
+#define SIR_VOLNUM     0x1B
+#define SIR_FREESTART  0x1D
+#define SIR_FREEEND    0x1F
+#define SIR_FREECOUNT  0x21
+#define SIR_DATE       0x23
+#define SIR_MAXTRACK   0x26
+#define SIR_MAXSECTOR  0x27
+
+// Directory location, and layout of entries within a directory sector
+#define DIR_TRACK    0
+#define DIR_SECTOR   5
+#define DIR_FIRST    16
+#define DIR_ENTSIZE  24
+#define DIR_ENTRIES  10
+
+// Field offsets within a directory entry
+#define ENT_NAME    0
+#define ENT_EXT     8
+#define ENT_ATTR    11
+#define ENT_START   13
+#define ENT_END     15
+#define ENT_SIZE    17
+#define ENT_RANDOM  19
+#define ENT_DATE    21
+
+// Starting value for fnvhash()
+#define FNV_INIT  0xCBF29CE484222325ULL
+
+/**
+ * @struct blockmap
+ * @brief How FLEX sectors are laid out in the physical blocks of a device.
+ * @details
+ *   Sectors are numbered in order track by track, and stored perblock
+ *   to a block from the start of each block, any remainder being unused.
+ *   If align is set, each track starts on a new block.
+ *   Plain images have 256-byte blocks of one sector each.
+ */
+struct blockmap {
+  int size;       ///< Physical block size in bytes
+  int perblock;   ///< FLEX sectors stored in each block
+  int align;      ///< Non-zero to start each track on a new block
+};
+
+/**
+ * @struct flexdisk
+ * @brief An open FLEX disk image.
+ */
+struct flexdisk {
+  FILE *f;                      ///< Image file, if not in memory
+  unsigned char *mem;           ///< Whole image, if held in memory
+  int tracks;                   ///< Number of tracks, from the SIR max track
+  int sectors;                  ///< Sectors per track, from the SIR max sector
+  unsigned char sir[SECSIZE];   ///< Cached System Information Record
+  struct blockmap map;          ///< Physical block layout of the file
+  unsigned char *block;         ///< Current physical block, if blocks are larger than sectors
+  long blockno;                 ///< Number of the current physical block, or -1
+  int dirty;                    ///< Current physical block needs writing back
+  long dirsecs;                 ///< Directory sectors visited by dirnext()
+};
+
+int parseblocks(const char *arg, struct blockmap *map);
+long slotoffset(const struct blockmap *map, long slot);
+int diskopen(struct flexdisk *d, const char *name, const char *mode, const struct blockmap *map);
+int diskcreate(struct flexdisk *d, int tracks, int sectors, const char *volname, int volnum);
+void formatsector(const struct flexdisk *d, int trk, int sec, unsigned char *buf);
+void formatsir(struct flexdisk *d, const char *volname, int volnum);
+int diskput(const struct flexdisk *d, FILE *f, const struct blockmap *map);
+int disksave(const struct flexdisk *d, const char *name, const struct blockmap *map);
+int diskclose(struct flexdisk *d);
+int diskread(struct flexdisk *d, int trk, int sec, unsigned char *buf);
+int diskwrite(struct flexdisk *d, int trk, int sec, const unsigned char *buf);
+int disksync(struct flexdisk *d);
+
+int freecount(const struct flexdisk *d);
+int freechain(struct flexdisk *d, int strk, int ssec, int etrk, int esec, int count);
+int diskgrow(struct flexdisk *d, int tracks);
+int writefile(struct flexdisk *d, const unsigned char *data, long len, unsigned char *ent);
+
+int dirnext(struct flexdisk *d, int *trk, int *sec, int *idx, unsigned char *buf);
+int dirfind(struct flexdisk *d, const char *name, int *trk, int *sec, int *idx, unsigned char *buf);
+int dirslot(struct flexdisk *d, int *trk, int *sec, int *idx, unsigned char *buf);
+
+int flexname(const char *host, char *name);
+void namestr(const unsigned char *ent, char *str);
+
+unsigned long long fnvhash(const unsigned char *data, long len, unsigned long long h);
+int hashfile(const char *name, unsigned long long *hash);
+
+#endif
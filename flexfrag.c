@@ -0,0 +1,459 @@
+/**
+ * @file flexfrag.c
+ * @brief FLEX disk image fragmentation analyser
+ * @details
+ *   See ./flexfrag -h for usage
+ *   Follows the chain of each file and the free chain once, counting
+ *   the runs of physically consecutive sectors and the track changes a
+ *   sequential read would need, and prints the results as JSON.
+ *   Results can be kept in a cache file keyed by a hash of the image
+ *   contents and the block layout, so unchanged images are only read
+ *   to hash them, and several images are analysed in parallel.
+ * @author David Knoll <david@davidknoll.me.uk>
+ * @copyright MIT License
+ */
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "flexdisk.h"
+#include "flexpool.h"
+
+/**
+ * @struct strbuf
+ * @brief A growing string.
+ */
+struct strbuf {
+  char *s;        ///< Contents, NUL-terminated
+  size_t len;     ///< Length, excluding the NUL
+  size_t size;    ///< Allocated size
+};
+
+/**
+ * @struct image
+ * @brief One image to analyse, and its results.
+ */
+struct image {
+  char *name;               ///< Filename
+  unsigned long long hash;  ///< FNV-1a hash of the contents
+  char *json;               ///< Results as a JSON object, without the filename
+  int cached;               ///< Results came from the cache
+  int error;                ///< Non-zero if it could not be analysed
+};
+
+/**
+ * @struct cacheent
+ * @brief Results from an earlier run, by image hash.
+ */
+struct cacheent {
+  unsigned long long hash;  ///< FNV-1a hash of the image contents
+  char *json;               ///< Results as a JSON object
+};
+
+struct blockmap blocks = { SECSIZE, 1, 0 };
+struct image *images = NULL;
+struct cacheent *cache = NULL;
+int nimages = 0, ncache = 0;
+
+/**
+ * @fn int append(struct strbuf *b, const char *fmt, ...)
+ * @brief Appends formatted text to a string, as printf(3).
+ * @return Zero on success, -1 if out of memory.
+ */
+int append(struct strbuf *b, const char *fmt, ...)
+{
+  va_list ap;
+  char *p;
+  int n;
+
+  va_start(ap, fmt);
+  n = vsnprintf(b->s + b->len, b->size - b->len, fmt, ap);
+  va_end(ap);
+  if (n < 0) return -1;
+  if (b->len + n >= b->size) {
+    p = realloc(b->s, b->len + n + 256);
+    if (p == NULL) return -1;
+    b->s = p;
+    b->size = b->len + n + 256;
+    va_start(ap, fmt);
+    vsnprintf(b->s + b->len, b->size - b->len, fmt, ap);
+    va_end(ap);
+  }
+  b->len += n;
+  return 0;
+}
+
+/**
+ * @fn int jsonstr(struct strbuf *b, const char *str, int ascii)
+ * @brief Appends a string as a quoted JSON string, escaping as needed.
+ * @details
+ *   FLEX names from damaged directories may hold quotes, backslashes,
+ *   control characters or bytes with the top bit set, so for those
+ *   ascii is set and every byte outside printable ASCII is escaped.
+ *   Host filenames are left as they are above 0x7F, as UTF-8.
+ * @return Zero on success, -1 if out of memory.
+ */
+int jsonstr(struct strbuf *b, const char *str, int ascii)
+{
+  if (append(b, "\"")) return -1;
+  for (; *str; str++) {
+    if (*str == '"' || *str == '\\') {
+      if (append(b, "\\%c", *str)) return -1;
+    } else if ((unsigned char) *str < 0x20 || (ascii && (unsigned char) *str >= 0x7F)) {
+      if (append(b, "\\u%04x", (unsigned char) *str)) return -1;
+    } else {
+      if (append(b, "%c", *str)) return -1;
+    }
+  }
+  return append(b, "\"");
+}
+
+/**
+ * @struct chainstat
+ * @brief What following one chain found.
+ */
+struct chainstat {
+  int sectors;    ///< Sectors in the chain
+  int runs;       ///< Runs of physically consecutive sectors
+  int seeks;      ///< Track changes reading it in order
+  int largest;    ///< Longest run
+};
+
+/**
+ * @fn int follow(struct flexdisk *d, int trk, int sec, struct chainstat *cs, struct strbuf *runs)
+ * @brief Follows a chain from the given sector, counting runs and track changes.
+ * @details
+ *   A sector continues a run if it is the next one on the same track,
+ *   or the first on the next track after the last one. A chain longer
+ *   than the disk must loop, and is an error.
+ * @param d Open disk.
+ * @param trk Track number of the first sector.
+ * @param sec Sector number of the first sector.
+ * @param cs Results.
+ * @param runs If not NULL, the length of each run is appended, comma-separated.
+ * @return Zero on success, -1 on error.
+ */
+int follow(struct flexdisk *d, int trk, int sec, struct chainstat *cs, struct strbuf *runs)
+{
+  unsigned char buf[SECSIZE];
+  long slot, prev = -2, limit = (long) d->tracks * d->sectors;
+  int prevtrk = trk, len = 0;
+
+  memset(cs, 0, sizeof(*cs));
+  while (trk || sec) {
+    if (cs->sectors == limit || diskread(d, trk, sec, buf)) return -1;
+    slot = (long) trk * d->sectors + sec - 1;
+    if (slot != prev + 1) {
+      if (len && runs != NULL && append(runs, "%s%d", cs->runs > 1 ? "," : "", len)) return -1;
+      cs->runs++;
+      len = 0;
+    }
+    if (++len > cs->largest) cs->largest = len;
+    if (trk != prevtrk) cs->seeks++;
+    cs->sectors++;
+    prev = slot;
+    prevtrk = trk;
+    trk = buf[0];
+    sec = buf[1];
+  }
+  if (len && runs != NULL && append(runs, "%s%d", cs->runs > 1 ? "," : "", len)) return -1;
+  return 0;
+}
+
+/**
+ * @fn int analyse(struct image *im, struct strbuf *json)
+ * @brief Analyses one image, producing its results as a JSON object.
+ * @details
+ *   A directory or file chain longer than the disk must loop, and makes
+ *   the whole image an error, so a damaged image cannot hang the walk.
+ * @param im Image.
+ * @param json Results, appended to.
+ * @return Zero on success, -1 on error.
+ */
+int analyse(struct image *im, struct strbuf *json)
+{
+  struct strbuf files = { NULL, 0, 0 }, freeruns = { NULL, 0, 0 };
+  unsigned char buf[SECSIZE], *ent;
+  struct chainstat cs, fs;
+  struct flexdisk d;
+  int trk, sec, idx = -1, result, nfiles = 0, fragmented = 0, runs = 0, seeks = 0;
+  char str[13];
+
+  if (diskopen(&d, im->name, "rb", &blocks)) return -1;
+  if (append(&files, "") || append(&freeruns, "")) result = -1;
+  else while ((result = dirnext(&d, &trk, &sec, &idx, buf)) == 1) {
+    ent = buf + DIR_FIRST + idx * DIR_ENTSIZE;
+    if (ent[ENT_NAME] == 0) break;
+    if (ent[ENT_NAME] & 0x80) continue;
+    namestr(ent, str);
+    if (follow(&d, ent[ENT_START], ent[ENT_START + 1], &cs, NULL) ||
+        append(&files, "%s{\"name\":", nfiles ? "," : "") || jsonstr(&files, str, 1) ||
+        append(&files, ",\"sectors\":%d,\"runs\":%d,\"seeks\":%d}", cs.sectors, cs.runs, cs.seeks)) {
+      result = -1;
+      break;
+    }
+    nfiles++;
+    if (cs.runs > 1) fragmented++;
+    runs += cs.runs;
+    seeks += cs.seeks;
+  }
+  if (result >= 0) {
+    result = follow(&d, d.sir[SIR_FREESTART], d.sir[SIR_FREESTART + 1], &fs, &freeruns);
+  }
+  if (result >= 0) {
+    result = append(json, "{\"hash\":\"%016llx\",\"tracks\":%d,\"sectors\":%d,"
+      "\"files\":%d,\"fragmented\":%d,\"runs\":%d,\"seeks\":%d,"
+      "\"free\":%d,\"freeruns\":%d,\"largestfree\":%d,\"freerunlengths\":[%s],"
+      "\"filestats\":[%s]}",
+      im->hash, d.tracks, d.sectors, nfiles, fragmented, runs, seeks,
+      fs.sectors, fs.runs, fs.largest, freeruns.s, files.s);
+  }
+  diskclose(&d);
+  free(files.s);
+  free(freeruns.s);
+  return (result < 0) ? -1 : 0;
+}
+
+/**
+ * @fn int byhash(const void *a, const void *b)
+ * @brief qsort(3) and bsearch(3) comparison of cache entries, by hash.
+ */
+int byhash(const void *a, const void *b)
+{
+  const struct cacheent *ca = a, *cb = b;
+  if (ca->hash == cb->hash) return 0;
+  return (ca->hash < cb->hash) ? -1 : 1;
+}
+
+/**
+ * @fn int analysejob(int i)
+ * @brief Analyses one image if it is not in the cache, run by the worker threads.
+ * @param i Index into images.
+ * @return Zero on success, non-zero on error.
+ */
+int analysejob(int i)
+{
+  struct cacheent key, *c;
+  struct strbuf json;
+
+  if (hashfile(images[i].name, &images[i].hash)) {
+    images[i].error = 1;
+    return images[i].error;
+  }
+  key.hash = images[i].hash;
+  c = ncache ? bsearch(&key, cache, ncache, sizeof(*cache), byhash) : NULL;
+  if (c != NULL) {
+    images[i].json = c->json;
+    images[i].cached = 1;
+    return 0;
+  }
+  memset(&json, 0, sizeof(json));
+  if (analyse(&images[i], &json)) {
+    free(json.s);
+    images[i].error = 1;
+    return images[i].error;
+  }
+  images[i].json = json.s;
+  return 0;
+}
+
+/**
+ * @fn int cacheload(const char *cachename)
+ * @brief Loads the cache file, if there is one.
+ * @details
+ *   Each line holds an image hash, the block layout as size,perblock,align
+ *   and a JSON object. Only lines for the current block layout are loaded.
+ * @param cachename Cache filename.
+ * @return Zero on success, -1 if out of memory.
+ */
+int cacheload(const char *cachename)
+{
+  FILE *f = fopen(cachename, "rt");
+  struct cacheent *p;
+  unsigned long long hash;
+  struct blockmap map;
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  int n = 0;
+
+  if (f == NULL) return 0;
+  while ((len = getline(&line, &size, f)) > 0) {
+    if (line[len - 1] == '\n') line[--len] = '\0';
+    if (sscanf(line, "%llx %d,%d,%d %n", &hash, &map.size, &map.perblock, &map.align, &n) != 4 ||
+        line[n] != '{' || map.size != blocks.size || map.perblock != blocks.perblock ||
+        map.align != blocks.align) continue;
+    p = realloc(cache, (ncache + 1) * sizeof(*cache));
+    if (p == NULL) break;
+    cache = p;
+    p += ncache;
+    p->hash = hash;
+    p->json = strdup(line + n);
+    if (p->json == NULL) break;
+    ncache++;
+  }
+  free(line);
+  fclose(f);
+  qsort(cache, ncache, sizeof(*cache), byhash);
+  return (len > 0) ? -1 : 0;
+}
+
+/**
+ * @fn int cachesave(const char *cachename)
+ * @brief Adds newly analysed images to the end of the cache file.
+ * @param cachename Cache filename.
+ * @return Zero on success, -1 on error.
+ */
+int cachesave(const char *cachename)
+{
+  FILE *f = fopen(cachename, "at");
+  int i, j;
+
+  if (f == NULL) return -1;
+  for (i = 0; i < nimages; i++) {
+    if (images[i].error || images[i].cached) continue;
+    // Identical images in one run need only one line
+    for (j = 0; j < i && (images[j].error || images[j].hash != images[i].hash); j++);
+    if (j < i) continue;
+    fprintf(f, "%016llx %d,%d,%d %s\n", images[i].hash, blocks.size, blocks.perblock, blocks.align,
+      images[i].json);
+  }
+  return fclose(f) ? -1 : 0;
+}
+
+/**
+ * @fn void printname(const char *name)
+ * @brief Outputs a filename as a JSON string.
+ */
+void printname(const char *name)
+{
+  static struct strbuf b = { NULL, 0, 0 };
+
+  b.len = 0;
+  if (jsonstr(&b, name, 0)) {
+    fputs("\"\"", stdout);
+    return;
+  }
+  fputs(b.s, stdout);
+}
+
+/**
+ * @fn int addimage(const char *name)
+ * @brief Adds an image to the list to be analysed.
+ * @param name Filename.
+ * @return Zero on success, -1 if out of memory.
+ */
+int addimage(const char *name)
+{
+  struct image *p = realloc(images, (nimages + 1) * sizeof(*images));
+  if (p == NULL) return -1;
+  images = p;
+  p += nimages++;
+  memset(p, 0, sizeof(*p));
+  p->name = strdup(name);
+  return (p->name == NULL) ? -1 : 0;
+}
+
+/**
+ * @fn void usage(const char *cmd)
+ * @brief Outputs help for the command.
+ * @param cmd Name of the program file, most likely from argv[0].
+ */
+void usage(const char *cmd)
+{
+  fprintf(stderr, "\
+FLEX disk image fragmentation analyser\n\
+Usage: %s [-b blocks] [-c cachefile] [-l listfile] [-j jobs] [-h] [image...]\n\
+\t-b is the physical block layout, as for mkflexfs\n\
+\t-c keeps results in cachefile, by hash of the image contents and blocks\n\
+\t-l also reads image filenames from listfile, one per line\n\
+\t-j is the number of images analysed in parallel, default 1\n\
+\t-h prints this message\n\
+Outputs a JSON array with an object for each image.\n\
+", cmd);
+  exit(EXIT_FAILURE);
+}
+
+/**
+ * @fn int main(int argc, char *argv[])
+ * @brief Main function
+ * @details Analyse the images in parallel, then output the results in order
+ * @param argc Command-line argument count
+ * @param argv Command-line arguments
+ * @return Zero on success, non-zero on error
+ */
+int main(int argc, char *argv[])
+{
+  int opt, i, jobs = 1, result = EXIT_SUCCESS;
+  char *cachename = NULL;
+
+  while ((opt = getopt(argc, argv, "b:c:l:j:h")) != -1) {
+    switch (opt) {
+      case 'b': // Physical block layout
+        if (parseblocks(optarg, &blocks)) usage(argv[0]);
+        break;
+      case 'c': // Cache file
+        cachename = optarg;
+        break;
+      case 'l': // List of images
+        if (readlist(optarg, addimage)) return EXIT_FAILURE;
+        break;
+      case 'j': // Parallel jobs
+        jobs = atoi(optarg);
+        if (jobs < 1) usage(argv[0]);
+        break;
+
+      case 'h': // Help/usage
+      case '?':
+      default:
+        usage(argv[0]);
+    }
+  }
+  for (i = optind; i < argc; i++) {
+    if (addimage(argv[i])) {
+      fprintf(stderr, "Out of memory\n");
+      return EXIT_FAILURE;
+    }
+  }
+  if (nimages == 0) usage(argv[0]);
+  if (cachename != NULL && cacheload(cachename)) {
+    fprintf(stderr, "Out of memory\n");
+    return EXIT_FAILURE;
+  }
+
+  // Analyse all images, errors are reported with the results
+  if (runpool(jobs, nimages, analysejob) < 0) {
+    fprintf(stderr, "Error creating thread\n");
+    return EXIT_FAILURE;
+  }
+
+  printf("[\n");
+  for (i = 0; i < nimages; i++) {
+    printf("{\"image\":");
+    printname(images[i].name);
+    if (images[i].error) {
+      fprintf(stderr, "Error analysing image %s\n", images[i].name);
+      printf(",\"error\":true}");
+      result = EXIT_FAILURE;
+    } else {
+      printf(",%s", images[i].json + 1);
+    }
+    printf("%s\n", (i + 1 < nimages) ? "," : "");
+  }
+  printf("]\n");
+
+  if (cachename != NULL && cachesave(cachename)) {
+    fprintf(stderr, "Error writing cache file %s, errno %d\n", cachename, errno);
+    result = EXIT_FAILURE;
+  }
+  for (i = 0; i < nimages; i++) {
+    free(images[i].name);
+    if (!images[i].cached) free(images[i].json);
+  }
+  for (i = 0; i < ncache; i++) free(cache[i].json);
+  free(images);
+  free(cache);
+  return result;
+}
@@ -0,0 +1,81 @@
+/**
+ * @file flexgrow.c
+ * @brief FLEX disk image grower
+ * @details
+ *   See ./flexgrow -h for usage
+ *   Adds tracks to an existing image in place. Only the new sectors are
+ *   written, and their chain is added to the end of the free chain,
+ *   so the time taken depends on the space added, not the whole disk.
+ * @author David Knoll <david@davidknoll.me.uk>
+ * @copyright MIT License
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "flexdisk.h"
+
+/**
+ * @fn void usage(const char *cmd)
+ * @brief Outputs help for the command.
+ * @param cmd Name of the program file, most likely from argv[0].
+ */
+void usage(const char *cmd)
+{
+  fprintf(stderr, "\
+FLEX disk image grower\n\
+Usage: %s -t tracks [-b blocks] [-h] image\n\
+\ttracks is the new number of tracks, max 256\n\
+\tblocks is the physical block layout, as for mkflexfs\n\
+\t-h prints this message\n\
+", cmd);
+  exit(EXIT_FAILURE);
+}
+
+/**
+ * @fn int main(int argc, char *argv[])
+ * @brief Main function
+ * @details Open the image, add the tracks and write back the SIR
+ * @param argc Command-line argument count
+ * @param argv Command-line arguments
+ * @return Zero on success, non-zero on error
+ */
+int main(int argc, char *argv[])
+{
+  struct blockmap blocks = { SECSIZE, 1, 0 };
+  struct flexdisk disk;
+  int opt, tracks = 0, oldtracks, result = EXIT_SUCCESS;
+
+  while ((opt = getopt(argc, argv, "t:b:h")) != -1) {
+    switch (opt) {
+      case 't': // Tracks
+        tracks = atoi(optarg);
+        if (tracks < 2 || tracks > 256) usage(argv[0]);
+        break;
+      case 'b': // Physical block layout
+        if (parseblocks(optarg, &blocks)) usage(argv[0]);
+        break;
+
+      case 'h': // Help/usage
+      case '?':
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (!tracks || argc - optind != 1) usage(argv[0]);
+
+  if (diskopen(&disk, argv[optind], "r+b", &blocks)) {
+    fprintf(stderr, "Error opening image %s, errno %d\n", argv[optind], errno);
+    return EXIT_FAILURE;
+  }
+  oldtracks = disk.tracks;
+  if (tracks <= oldtracks) {
+    fprintf(stderr, "Image %s already has %d tracks\n", argv[optind], oldtracks);
+    result = EXIT_FAILURE;
+  } else if (diskgrow(&disk, tracks) || disksync(&disk)) {
+    fprintf(stderr, "Error growing image %s\n", argv[optind]);
+    result = EXIT_FAILURE;
+  }
+  if (diskclose(&disk)) result = EXIT_FAILURE;
+  return result;
+}
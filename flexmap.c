@@ -0,0 +1,307 @@
+/**
+ * @file flexmap.c
+ * @brief FLEX binary memory map conflict finder
+ * @details
+ *   See ./flexmap -h for usage
+ *   Reads the records of each FLEX binary as flex2sr does, finds the
+ *   address ranges each one loads into, and reports every overlap
+ *   between different binaries, or between a binary and a reserved range.
+ * @author David Knoll <david@davidknoll.me.uk>
+ * @copyright MIT License
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "flexbin.h"
+#include "flexpool.h"
+
+#define MAXRESERVED 32
+
+/**
+ * @struct interval
+ * @brief An address range loaded by one binary, or reserved.
+ */
+struct interval {
+  unsigned int start, end;  ///< First and last address, inclusive
+  int owner;                ///< Index into files, or -1 if reserved
+};
+
+/**
+ * @struct binfile
+ * @brief One binary and the ranges it loads into.
+ */
+struct binfile {
+  char *name;               ///< Filename
+  struct interval *iv;      ///< Ranges, in address order
+  int niv;                  ///< Number of ranges
+  int error;                ///< Non-zero if it could not be read
+};
+
+struct binfile *files = NULL;
+struct interval reserved[MAXRESERVED];
+int nfiles = 0, nreserved = 0;
+
+/**
+ * @fn int record(FILE *infile, unsigned char *map)
+ * @brief Processes one record from a FLEX binary, marking the bytes it loads.
+ * @details
+ *   Records are read by binrecord(), as flex2sr does.
+ *   Unrecognised record type identifiers are returned and not processed further.
+ * @param infile Open file pointer to the input FLEX binary.
+ * @param map Bitmap of 64K addresses, a bit is set for each byte loaded.
+ * @return
+ *   The record type processed.
+ *   Most likely 0x02 or 0x16.
+ *   EOF if encountered.
+ *   BIN_TRUNCATED if the input ends part way through a record.
+ *   Something else if an unrecognised record type.
+ */
+int record(FILE *infile, unsigned char *map)
+{
+  struct binrec rec;
+  unsigned int loadaddr;
+  int rectype, i;
+
+  rectype = binrecord(infile, &rec);
+  if (rectype == BIN_DATA) {
+    loadaddr = rec.addr;
+    for (i = 0; i < rec.len; i++) {
+      map[loadaddr >> 3] |= 1 << (loadaddr & 7);
+      loadaddr = (loadaddr + 1) & 0xFFFF;
+    }
+  }
+  return rectype;
+}
+
+/**
+ * @fn int scan(struct binfile *bf, unsigned char *map)
+ * @brief Reads a binary and converts the bytes it loads into ranges.
+ * @param bf Binary, whose ranges are filled in.
+ * @param map Bitmap of 64K bytes to work in.
+ * @return Zero on success, -1 on error.
+ */
+int scan(struct binfile *bf, unsigned char *map)
+{
+  struct interval *p;
+  FILE *infile;
+  unsigned int addr, start;
+  int rectype;
+
+  memset(map, 0, 0x10000 / 8);
+  infile = fopen(bf->name, "rb");
+  if (infile == NULL) {
+    fprintf(stderr, "Error opening file %s for input.\n", bf->name);
+    return -1;
+  }
+  do {
+    rectype = record(infile, map);
+  } while (rectype == BIN_DATA || rectype == BIN_TRANSFER);
+  if (rectype == BIN_TRUNCATED) {
+    fprintf(stderr, "Truncated record at end of input file %s.\n", bf->name);
+    fclose(infile);
+    return -1;
+  }
+  if (rectype != EOF) {
+    fprintf(stderr, "Unrecognised record type %02X at offset %04X in input file %s.\n",
+      rectype, (int) ftell(infile) - 1, bf->name);
+    fclose(infile);
+    return -1;
+  }
+  fclose(infile);
+
+  // Each run of set bits is a range
+  for (addr = 0; addr < 0x10000; addr++) {
+    if (!(addr & 7) && !map[addr >> 3]) {
+      addr += 7;
+      continue;
+    }
+    if (!(map[addr >> 3] & (1 << (addr & 7)))) continue;
+    for (start = addr; addr + 1 < 0x10000 && (map[(addr + 1) >> 3] & (1 << ((addr + 1) & 7))); addr++);
+    p = realloc(bf->iv, (bf->niv + 1) * sizeof(*bf->iv));
+    if (p == NULL) return -1;
+    bf->iv = p;
+    p += bf->niv++;
+    p->start = start;
+    p->end = addr;
+    p->owner = bf - files;
+  }
+  return 0;
+}
+
+/**
+ * @fn int scanjob(int i)
+ * @brief Scans one binary, run by the worker threads.
+ * @param i Index into files.
+ * @return Zero on success, non-zero on error.
+ */
+int scanjob(int i)
+{
+  static __thread unsigned char map[0x10000 / 8];
+
+  files[i].error = scan(&files[i], map);
+  return files[i].error;
+}
+
+/**
+ * @fn int bystart(const void *a, const void *b)
+ * @brief qsort(3) comparison, by start address, then end, then owner.
+ */
+int bystart(const void *a, const void *b)
+{
+  const struct interval *ia = a, *ib = b;
+  if (ia->start != ib->start) return (ia->start < ib->start) ? -1 : 1;
+  if (ia->end != ib->end) return (ia->end < ib->end) ? -1 : 1;
+  return ia->owner - ib->owner;
+}
+
+/**
+ * @fn const char *ownername(int owner)
+ * @brief Returns the name to report for an interval owner.
+ */
+const char *ownername(int owner)
+{
+  return (owner < 0) ? "reserved" : files[owner].name;
+}
+
+/**
+ * @fn long conflicts(void)
+ * @brief Reports every overlap between ranges with different owners.
+ * @details
+ *   All ranges are sorted by start address and swept in order. As each
+ *   binary's own ranges never overlap each other, every later range
+ *   starting within the current one is a conflict, so the sweep takes
+ *   O(n log n + k) for n ranges and k conflicts.
+ * @return Number of conflicts reported, or -1 if out of memory.
+ */
+long conflicts(void)
+{
+  struct interval *iv;
+  long count = 0;
+  int n = nreserved, i, j;
+
+  for (i = 0; i < nfiles; i++) n += files[i].niv;
+  iv = malloc((n ? n : 1) * sizeof(*iv));
+  if (iv == NULL) return -1;
+  memcpy(iv, reserved, nreserved * sizeof(*iv));
+  for (n = nreserved, i = 0; i < nfiles; i++) {
+    memcpy(iv + n, files[i].iv, files[i].niv * sizeof(*iv));
+    n += files[i].niv;
+  }
+  qsort(iv, n, sizeof(*iv), bystart);
+
+  for (i = 0; i < n; i++) {
+    for (j = i + 1; j < n && iv[j].start <= iv[i].end; j++) {
+      if (iv[i].owner == iv[j].owner) continue;
+      printf("%04X-%04X %s %s\n", iv[j].start, (iv[j].end < iv[i].end) ? iv[j].end : iv[i].end,
+        ownername(iv[i].owner), ownername(iv[j].owner));
+      count++;
+    }
+  }
+  free(iv);
+  return count;
+}
+
+/**
+ * @fn int addfile(const char *name)
+ * @brief Adds a binary to the list to be scanned.
+ * @param name Filename.
+ * @return Zero on success, -1 if out of memory.
+ */
+int addfile(const char *name)
+{
+  struct binfile *p = realloc(files, (nfiles + 1) * sizeof(*files));
+  if (p == NULL) return -1;
+  files = p;
+  p += nfiles++;
+  memset(p, 0, sizeof(*p));
+  p->name = strdup(name);
+  return (p->name == NULL) ? -1 : 0;
+}
+
+/**
+ * @fn void usage(const char *cmd)
+ * @brief Outputs help for the command.
+ * @param cmd Name of the program file, most likely from argv[0].
+ */
+void usage(const char *cmd)
+{
+  fprintf(stderr, "\
+FLEX binary memory map conflict finder\n\
+Usage: %s [-r start-end]... [-l listfile] [-j jobs] [-h] [file...]\n\
+\t-r reserves the addresses from start to end inclusive (hex),\n\
+\t   such as CC00-DFFF for FLEX itself, may be given up to 32 times\n\
+\t-l also reads binary filenames from listfile, one per line\n\
+\t-j is the number of binaries read in parallel, default 1\n\
+\t-h prints this message\n\
+Each overlap is output as the address range and the two files.\n\
+", cmd);
+  exit(EXIT_FAILURE);
+}
+
+/**
+ * @fn int main(int argc, char *argv[])
+ * @brief Main function
+ * @details Scan the binaries in parallel, then report conflicts
+ * @param argc Command-line argument count
+ * @param argv Command-line arguments
+ * @return Zero on success, non-zero on error
+ */
+int main(int argc, char *argv[])
+{
+  int opt, i, jobs = 1, failed, result = EXIT_SUCCESS;
+  unsigned int start, end;
+  char c;
+
+  while ((opt = getopt(argc, argv, "r:l:j:h")) != -1) {
+    switch (opt) {
+      case 'r': // Reserved range
+        if (nreserved == MAXRESERVED ||
+            sscanf(optarg, "%x-%x%c", &start, &end, &c) != 2 ||
+            start > end || end > 0xFFFF) usage(argv[0]);
+        reserved[nreserved].start = start;
+        reserved[nreserved].end = end;
+        reserved[nreserved++].owner = -1;
+        break;
+      case 'l': // List of binaries
+        if (readlist(optarg, addfile)) return EXIT_FAILURE;
+        break;
+      case 'j': // Parallel jobs
+        jobs = atoi(optarg);
+        if (jobs < 1) usage(argv[0]);
+        break;
+
+      case 'h': // Help/usage
+      case '?':
+      default:
+        usage(argv[0]);
+    }
+  }
+  for (i = optind; i < argc; i++) {
+    if (addfile(argv[i])) {
+      fprintf(stderr, "Out of memory\n");
+      return EXIT_FAILURE;
+    }
+  }
+  if (nfiles == 0) usage(argv[0]);
+
+  // Scan all binaries
+  failed = runpool(jobs, nfiles, scanjob);
+  if (failed < 0) {
+    fprintf(stderr, "Error creating thread\n");
+    return EXIT_FAILURE;
+  }
+  if (failed) result = EXIT_FAILURE;
+
+  if (conflicts() < 0) {
+    fprintf(stderr, "Out of memory\n");
+    result = EXIT_FAILURE;
+  }
+  for (i = 0; i < nfiles; i++) {
+    free(files[i].name);
+    free(files[i].iv);
+  }
+  free(files);
+  return result;
+}
@@ -0,0 +1,327 @@
+/**
+ * @file flexowner.c
+ * @brief FLEX disk image sector owner lookup
+ * @details
+ *   See ./flexowner -h for usage
+ *   Walks the directory, every file and the free chain once, recording
+ *   the owner of each sector in an array indexed by track and sector,
+ *   so each lookup afterwards is a single array access. The map can be
+ *   kept in a sidecar file next to the image (image name plus .own),
+ *   which is rebuilt only when the image's contents or the block layout
+ *   have changed. Checking this reads the image once in order, which is
+ *   much cheaper than following every chain.
+ * @author David Knoll <david@davidknoll.me.uk>
+ * @copyright MIT License
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "flexdisk.h"
+
+// Owner codes below OWN_FILE, at or above it they index names
+#define OWN_UNUSED  0   ///< In no chain at all
+#define OWN_SYSTEM  1   ///< Boot sectors and SIR
+#define OWN_DIR     2   ///< Directory chain
+#define OWN_FREE    3   ///< Free chain
+#define OWN_MULTI   4   ///< In more than one chain
+#define OWN_FILE    5
+
+struct flexdisk disk;
+struct blockmap blocks = { SECSIZE, 1, 0 };
+int tracks, sectors, nnames = 0;
+unsigned short *owner = NULL;
+char (*names)[13] = NULL;
+unsigned long long imagehash;
+
+/**
+ * @fn int claim(int trk, int sec, int own)
+ * @brief Records the owner of one sector.
+ * @param trk Track number.
+ * @param sec Sector number.
+ * @param own Owner code.
+ * @return Zero if the sector was unowned, 1 if it was already owned, -1 if out of range.
+ */
+int claim(int trk, int sec, int own)
+{
+  unsigned short *p;
+
+  if (trk >= tracks || sec < 1 || sec > sectors) return -1;
+  p = &owner[trk * sectors + sec - 1];
+  if (*p == OWN_UNUSED) {
+    *p = own;
+    return 0;
+  }
+  *p = OWN_MULTI;
+  return 1;
+}
+
+/**
+ * @fn int walk(int trk, int sec, int own)
+ * @brief Follows a chain of sectors from the given one, claiming each for an owner.
+ * @details Stops at a sector already owned, so a looped or crossed chain ends there.
+ * @param trk Track number of the first sector.
+ * @param sec Sector number of the first sector.
+ * @param own Owner code.
+ * @return Zero on success, -1 on read error.
+ */
+int walk(int trk, int sec, int own)
+{
+  unsigned char buf[SECSIZE];
+
+  while ((trk || sec) && claim(trk, sec, own) == 0) {
+    if (diskread(&disk, trk, sec, buf)) return -1;
+    trk = buf[0];
+    sec = buf[1];
+  }
+  return 0;
+}
+
+/**
+ * @fn int build(void)
+ * @brief Builds the owner map from the open image.
+ * @return Zero on success, -1 on error.
+ */
+int build(void)
+{
+  unsigned char buf[SECSIZE], *ent;
+  char (*p)[13];
+  int trk, sec, idx = -1, result;
+
+  owner = calloc(tracks * sectors, sizeof(*owner));
+  if (owner == NULL) return -1;
+  for (sec = 1; sec < DIR_SECTOR; sec++) claim(0, sec, OWN_SYSTEM);
+  if (walk(DIR_TRACK, DIR_SECTOR, OWN_DIR)) return -1;
+  if (walk(disk.sir[SIR_FREESTART], disk.sir[SIR_FREESTART + 1], OWN_FREE)) return -1;
+
+  while ((result = dirnext(&disk, &trk, &sec, &idx, buf)) == 1) {
+    ent = buf + DIR_FIRST + idx * DIR_ENTSIZE;
+    if (ent[ENT_NAME] == 0) break;
+    if (ent[ENT_NAME] & 0x80) continue;
+    if (OWN_FILE + nnames > 0xFFFF) return -1;
+    p = realloc(names, (nnames + 1) * sizeof(*names));
+    if (p == NULL) return -1;
+    names = p;
+    namestr(ent, names[nnames]);
+    if (walk(ent[ENT_START], ent[ENT_START + 1], OWN_FILE + nnames++)) return -1;
+  }
+  return (result < 0) ? -1 : 0;
+}
+
+/**
+ * @fn int cacheload(const char *sidename)
+ * @brief Loads the owner map from the sidecar file, if it matches the image.
+ * @details
+ *   The sidecar holds the image hash, block layout and geometry, the file
+ *   names in directory order, then the map as runs of sectors with one owner.
+ * @param sidename Sidecar filename.
+ * @return Zero if loaded, -1 if missing, stale or unreadable.
+ */
+int cacheload(const char *sidename)
+{
+  FILE *f = fopen(sidename, "rt");
+  unsigned long long hash;
+  struct blockmap map;
+  long start, count, n;
+  int own, i;
+
+  if (f == NULL) return -1;
+  if (fscanf(f, "%llx %d %d %d %d %d %d", &hash, &map.size, &map.perblock, &map.align,
+        &tracks, &sectors, &nnames) != 7 ||
+      hash != imagehash || map.size != blocks.size || map.perblock != blocks.perblock ||
+      map.align != blocks.align ||
+      tracks < 2 || tracks > 256 || sectors < 5 || sectors > 255 || nnames < 0) goto stale;
+  n = (long) tracks * sectors;
+  names = malloc((nnames ? nnames : 1) * sizeof(*names));
+  owner = malloc(n * sizeof(*owner));
+  if (names == NULL || owner == NULL) goto stale;
+  for (i = 0; i < nnames; i++) {
+    if (fscanf(f, "%12s", names[i]) != 1) goto stale;
+  }
+  for (start = 0; start < n; start += count) {
+    if (fscanf(f, "%ld %d", &count, &own) != 2 || count < 1 || count > n - start ||
+        own < 0 || own >= OWN_FILE + nnames) goto stale;
+    for (i = 0; i < count; i++) owner[start + i] = own;
+  }
+  fclose(f);
+  return 0;
+
+stale:
+  fclose(f);
+  free(names);
+  free(owner);
+  names = NULL;
+  owner = NULL;
+  nnames = 0;
+  return -1;
+}
+
+/**
+ * @fn int cachesave(const char *sidename)
+ * @brief Writes the owner map to the sidecar file.
+ * @param sidename Sidecar filename.
+ * @return Zero on success, -1 on error.
+ */
+int cachesave(const char *sidename)
+{
+  FILE *f = fopen(sidename, "wt");
+  long n = (long) tracks * sectors, start, end;
+  int i;
+
+  if (f == NULL) return -1;
+  fprintf(f, "%016llx %d %d %d %d %d %d\n", imagehash, blocks.size, blocks.perblock, blocks.align,
+    tracks, sectors, nnames);
+  for (i = 0; i < nnames; i++) fprintf(f, "%s\n", names[i]);
+  for (start = 0; start < n; start = end) {
+    for (end = start + 1; end < n && owner[end] == owner[start]; end++);
+    fprintf(f, "%ld %d\n", end - start, owner[start]);
+  }
+  return fclose(f) ? -1 : 0;
+}
+
+/**
+ * @fn const char *ownername(int own)
+ * @brief Returns the name to report for an owner code.
+ */
+const char *ownername(int own)
+{
+  static const char *special[] = { "unused", "system", "directory", "free", "multiple" };
+  return (own < OWN_FILE) ? special[own] : names[own - OWN_FILE];
+}
+
+/**
+ * @fn void query(const char *arg)
+ * @brief Looks up and prints the owner of one sector.
+ * @param arg Track and sector in hex, as TT,SS or TTSS.
+ */
+void query(const char *arg)
+{
+  unsigned int trk, sec;
+  char c;
+
+  if ((sscanf(arg, "%x,%x%c", &trk, &sec, &c) != 2 &&
+       (strlen(arg) != 4 || sscanf(arg, "%2x%2x", &trk, &sec) != 2)) ||
+      trk >= (unsigned int) tracks || sec < 1 || sec > (unsigned int) sectors) {
+    printf("%s invalid\n", arg);
+    return;
+  }
+  printf("%02X,%02X %s\n", trk, sec, ownername(owner[trk * sectors + sec - 1]));
+}
+
+/**
+ * @fn void list(void)
+ * @brief Prints the whole map, as runs of sectors with one owner.
+ */
+void list(void)
+{
+  long n = (long) tracks * sectors, start, end;
+
+  for (start = 0; start < n; start = end) {
+    for (end = start + 1; end < n && owner[end] == owner[start]; end++);
+    printf("%02lX,%02lX-%02lX,%02lX %s\n", start / sectors, start % sectors + 1,
+      (end - 1) / sectors, (end - 1) % sectors + 1, ownername(owner[start]));
+  }
+}
+
+/**
+ * @fn void usage(const char *cmd)
+ * @brief Outputs help for the command.
+ * @param cmd Name of the program file, most likely from argv[0].
+ */
+void usage(const char *cmd)
+{
+  fprintf(stderr, "\
+FLEX disk image sector owner lookup\n\
+Usage: %s [-b blocks] [-c] [-l] [-h] image [sector...]\n\
+\t-b is the physical block layout, as for mkflexfs\n\
+\t-c keeps the map in image.own alongside the image, reused\n\
+\t   while the image contents and block layout are unchanged\n\
+\t-l lists the owner of every run of sectors\n\
+\t-h prints this message\n\
+Each sector is given as track and sector in hex, as TT,SS or TTSS,\n\
+or one per line on standard input if none are given.\n\
+Owners are a file name, free, directory, system, unused or multiple.\n\
+", cmd);
+  exit(EXIT_FAILURE);
+}
+
+/**
+ * @fn int main(int argc, char *argv[])
+ * @brief Main function
+ * @details Load or build the map, then answer each query
+ * @param argc Command-line argument count
+ * @param argv Command-line arguments
+ * @return Zero on success, non-zero on error
+ */
+int main(int argc, char *argv[])
+{
+  int opt, cache = 0, listall = 0, i;
+  char line[64], *image, *sidename = NULL;
+
+  while ((opt = getopt(argc, argv, "b:clh")) != -1) {
+    switch (opt) {
+      case 'b': // Physical block layout
+        if (parseblocks(optarg, &blocks)) usage(argv[0]);
+        break;
+      case 'c': // Use the sidecar
+        cache = 1;
+        break;
+      case 'l': // List the whole map
+        listall = 1;
+        break;
+
+      case 'h': // Help/usage
+      case '?':
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (optind >= argc) usage(argv[0]);
+  image = argv[optind++];
+
+  if (cache) {
+    sidename = malloc(strlen(image) + 5);
+    if (sidename == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      return EXIT_FAILURE;
+    }
+    sprintf(sidename, "%s.own", image);
+    if (hashfile(image, &imagehash)) {
+      fprintf(stderr, "Error reading image %s, errno %d\n", image, errno);
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Walk the image only if there is no up to date sidecar
+  if (!cache || cacheload(sidename)) {
+    if (diskopen(&disk, image, "rb", &blocks)) {
+      fprintf(stderr, "Error opening image %s, errno %d\n", image, errno);
+      return EXIT_FAILURE;
+    }
+    tracks = disk.tracks;
+    sectors = disk.sectors;
+    if (build()) {
+      fprintf(stderr, "Error reading image %s\n", image);
+      diskclose(&disk);
+      return EXIT_FAILURE;
+    }
+    diskclose(&disk);
+    if (cache && cachesave(sidename)) {
+      fprintf(stderr, "Error writing %s, errno %d\n", sidename, errno);
+    }
+  }
+
+  if (listall) list();
+  for (i = optind; i < argc; i++) query(argv[i]);
+  if (!listall && optind == argc) {
+    while (fgets(line, sizeof(line), stdin) != NULL) {
+      line[strcspn(line, " \t\r\n")] = '\0';
+      if (*line) query(line);
+    }
+  }
+  free(sidename);
+  free(owner);
+  free(names);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,105 @@
+/**
+ * @file flexpool.c
+ * @brief File lists and worker threads for batch tools
+ * @details
+ *   Each thread in the pool takes the next item number from a shared
+ *   counter until there are none left, so items are spread over the
+ *   threads however long each one takes. Only one pool runs at a time.
+ * @author David Knoll <david@davidknoll.me.uk>
+ * @copyright MIT License
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "flexpool.h"
+
+static int (*pooljob)(int i);
+static int poolsize, next, failed;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @fn int readlist(const char *listname, int (*add)(const char *name))
+ * @brief Adds each filename in a list, one per line.
+ * @details Blank lines and lines starting with # are skipped.
+ * @param listname List filename, or - for standard input.
+ * @param add Called with each filename, returns non-zero on error.
+ * @return Zero on success, -1 on error.
+ */
+int readlist(const char *listname, int (*add)(const char *name))
+{
+  static char line[FILENAME_MAX + 2];
+  FILE *list;
+
+  list = strcmp("-", listname) ? fopen(listname, "rt") : stdin;
+  if (list == NULL) {
+    fprintf(stderr, "Error opening file %s for input, errno %d\n", listname, errno);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), list) != NULL) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (*line == '\0' || *line == '#') continue;
+    if (add(line)) {
+      fprintf(stderr, "Out of memory\n");
+      if (list != stdin) fclose(list);
+      return -1;
+    }
+  }
+  if (list != stdin) fclose(list);
+  return 0;
+}
+
+/**
+ * @fn static void *worker(void *arg)
+ * @brief Thread taking items from the shared counter and running the job on each.
+ * @param arg Unused.
+ * @return NULL
+ */
+static void *worker(void *arg)
+{
+  int i;
+
+  (void) arg;
+  for (;;) {
+    pthread_mutex_lock(&lock);
+    i = next++;
+    pthread_mutex_unlock(&lock);
+    if (i >= poolsize) break;
+    if (pooljob(i)) {
+      pthread_mutex_lock(&lock);
+      failed++;
+      pthread_mutex_unlock(&lock);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @fn int runpool(int jobs, int n, int (*job)(int i))
+ * @brief Runs a job for each of n items, up to jobs at a time in parallel.
+ * @param jobs Number of threads, reduced to n if more.
+ * @param n Number of items.
+ * @param job Called with each item number from 0 to n-1, returns non-zero on error.
+ * @return Number of jobs that failed, or -1 if no thread could be created.
+ */
+int runpool(int jobs, int n, int (*job)(int i))
+{
+  pthread_t *threads;
+  int i, started;
+
+  if (jobs > n) jobs = n;
+  if (jobs < 1) return 0;
+  threads = malloc(jobs * sizeof(*threads));
+  if (threads == NULL) return -1;
+  pooljob = job;
+  poolsize = n;
+  next = failed = 0;
+  // Any threads that did start still get through every item
+  for (started = 0; started < jobs; started++) {
+    if (pthread_create(&threads[started], NULL, worker, NULL)) break;
+  }
+  for (i = 0; i < started; i++) pthread_join(threads[i], NULL);
+  free(threads);
+  return started ? failed : -1;
+}
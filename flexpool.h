@@ -0,0 +1,17 @@
+/**
+ * @file flexpool.h
+ * @brief File lists and worker threads for batch tools
+ * @details
+ *   Reads lists of filenames, and runs a job for each item of a list
+ *   on a pool of threads, shared by the tools that process many files
+ *   or images in parallel.
+ * @author David Knoll <david@davidknoll.me.uk>
+ * @copyright MIT License
+ */
+#ifndef FLEXPOOL_H
+#define FLEXPOOL_H
+
+int readlist(const char *listname, int (*add)(const char *name));
+int runpool(int jobs, int n, int (*job)(int i));
+
+#endif
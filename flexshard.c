@@ -0,0 +1,284 @@
+/**
+ * @file flexshard.c
+ * @brief Batch list sharder and report merger
+ * @details
+ *   See ./flexshard -h for usage
+ *   Splits a list for the -l option of flex2sr or sr2flex into shards
+ *   of similar total input size, to be run on separate machines or
+ *   processes, then merges the reports they output.
+ * @author David Knoll <david@davidknoll.me.uk>
+ * @copyright MIT License
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * @struct entry
+ * @brief One line of a list or report.
+ */
+struct entry {
+  char *text;   ///< Whole line, without newline
+  char *name;   ///< Input filename, for sorting
+  long size;    ///< Input size in bytes
+  int index;    ///< Position in the original list
+  int shard;    ///< Shard assigned
+};
+
+struct entry *entries = NULL;
+int nentries = 0;
+
+/**
+ * @fn int addentry(const char *line, const char *name, long size)
+ * @brief Adds a line to the entry table.
+ * @param line Whole line.
+ * @param name Input filename within the line.
+ * @param size Input size in bytes.
+ * @return Zero on success, -1 if out of memory.
+ */
+int addentry(const char *line, const char *name, long size)
+{
+  struct entry *p = realloc(entries, (nentries + 1) * sizeof(*entries));
+  if (p == NULL) return -1;
+  entries = p;
+  p = &entries[nentries];
+  p->text = strdup(line);
+  p->name = strdup(name);
+  if (p->text == NULL || p->name == NULL) return -1;
+  p->size = size;
+  p->index = nentries++;
+  p->shard = 0;
+  return 0;
+}
+
+/**
+ * @fn int bysize(const void *a, const void *b)
+ * @brief qsort(3) comparison, largest input first, then list order.
+ */
+int bysize(const void *a, const void *b)
+{
+  const struct entry *ea = a, *eb = b;
+  if (ea->size != eb->size) return (ea->size < eb->size) ? 1 : -1;
+  return ea->index - eb->index;
+}
+
+/**
+ * @fn int byindex(const void *a, const void *b)
+ * @brief qsort(3) comparison, list order.
+ */
+int byindex(const void *a, const void *b)
+{
+  return ((const struct entry *) a)->index - ((const struct entry *) b)->index;
+}
+
+/**
+ * @fn int byname(const void *a, const void *b)
+ * @brief qsort(3) comparison, input filename, then order read.
+ */
+int byname(const void *a, const void *b)
+{
+  const struct entry *ea = a, *eb = b;
+  int result = strcmp(ea->name, eb->name);
+  return result ? result : ea->index - eb->index;
+}
+
+/**
+ * @fn int split(const char *listname, const char *prefix, int nshards)
+ * @brief Splits a list into shards of similar total input size.
+ * @details
+ *   Inputs are assigned largest first, each to the shard with the least
+ *   total so far, lowest numbered on a tie. The result depends only on
+ *   the list and the input sizes. Each shard keeps the list order.
+ *   Blank and comment lines are dropped; inputs which can't be found
+ *   count as size zero, and will be reported as errors when converted.
+ * @param listname List filename, or - for standard input.
+ * @param prefix Shard filenames are this with .0, .1 etc. appended.
+ * @param nshards Number of shards.
+ * @return Zero on success, -1 on error.
+ */
+int split(const char *listname, const char *prefix, int nshards)
+{
+  static char line[2 * FILENAME_MAX + 2];
+  char *name, *shardname;
+  long *load;
+  struct stat st;
+  FILE *list, *f;
+  int i, j, min;
+
+  list = strcmp("-", listname) ? fopen(listname, "rt") : stdin;
+  if (list == NULL) {
+    fprintf(stderr, "Error opening file %s for input, errno %d\n", listname, errno);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), list) != NULL) {
+    line[strcspn(line, "\r\n")] = '\0';
+    name = line + strspn(line, " \t");
+    if (*name == '\0' || *name == '#') continue;
+    name = strndup(name, strcspn(name, " \t"));
+    if (name == NULL || addentry(line, name, stat(name, &st) ? 0 : st.st_size)) {
+      fprintf(stderr, "Out of memory\n");
+      return -1;
+    }
+    free(name);
+  }
+  if (list != stdin) fclose(list);
+
+  // Largest first, to the least loaded shard
+  load = calloc(nshards, sizeof(*load));
+  shardname = malloc(strlen(prefix) + 16);
+  if (load == NULL || shardname == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return -1;
+  }
+  qsort(entries, nentries, sizeof(*entries), bysize);
+  for (i = 0; i < nentries; i++) {
+    for (min = 0, j = 1; j < nshards; j++) {
+      if (load[j] < load[min]) min = j;
+    }
+    entries[i].shard = min;
+    load[min] += entries[i].size;
+  }
+  qsort(entries, nentries, sizeof(*entries), byindex);
+
+  for (j = 0; j < nshards; j++) {
+    sprintf(shardname, "%s.%d", prefix, j);
+    f = fopen(shardname, "wt");
+    if (f == NULL) {
+      fprintf(stderr, "Error opening file %s for output, errno %d\n", shardname, errno);
+      return -1;
+    }
+    for (i = 0; i < nentries; i++) {
+      if (entries[i].shard == j) fprintf(f, "%s\n", entries[i].text);
+    }
+    if (fclose(f)) {
+      fprintf(stderr, "Error writing file %s\n", shardname);
+      return -1;
+    }
+    fprintf(stderr, "%s: %ld bytes\n", shardname, load[j]);
+  }
+
+  free(load);
+  free(shardname);
+  return 0;
+}
+
+/**
+ * @fn int merge(int nreports, char *reports[])
+ * @brief Merges batch reports into one, with totals.
+ * @details
+ *   Result lines are output sorted by input filename, so the merged
+ *   report is the same however the list was split. A final comment line
+ *   gives the number of files, how many succeeded and failed, and the
+ *   total input size of each.
+ * @param nreports Number of report files.
+ * @param reports Report filenames.
+ * @return Zero if all files succeeded, 1 if any failed, -1 on error.
+ */
+int merge(int nreports, char *reports[])
+{
+  static char line[2 * FILENAME_MAX + 32];
+  char status[4], name[FILENAME_MAX];
+  long size, okfiles = 0, okbytes = 0, errfiles = 0, errbytes = 0;
+  FILE *f;
+  int i;
+
+  for (i = 0; i < nreports; i++) {
+    f = fopen(reports[i], "rt");
+    if (f == NULL) {
+      fprintf(stderr, "Error opening file %s for input, errno %d\n", reports[i], errno);
+      return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+      line[strcspn(line, "\r\n")] = '\0';
+      if (sscanf(line, "%3s %ld %4095s", status, &size, name) != 3) continue;
+      if (addentry(line, name, size)) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+      }
+      if (!strcmp(status, "OK")) {
+        okfiles++;
+        okbytes += size;
+      } else {
+        errfiles++;
+        if (size > 0) errbytes += size;
+      }
+    }
+    fclose(f);
+  }
+
+  qsort(entries, nentries, sizeof(*entries), byname);
+  for (i = 0; i < nentries; i++) printf("%s\n", entries[i].text);
+  printf("# files %ld ok %ld %ld bytes err %ld %ld bytes\n",
+    okfiles + errfiles, okfiles, okbytes, errfiles, errbytes);
+  return errfiles ? 1 : 0;
+}
+
+/**
+ * @fn void usage(const char *cmd)
+ * @brief Outputs help for the command.
+ * @param cmd Name of the program file, most likely from argv[0].
+ */
+void usage(const char *cmd)
+{
+  fprintf(stderr, "\
+Batch list sharder and report merger\n\
+Usage: %s -n shards [-o prefix] listfile\n\
+       %s -m reportfile...\n\
+\t-n splits listfile into prefix.0 to prefix.N-1, balanced by input size\n\
+\t-o is the prefix for shard filenames, default listfile,\n\
+\t   required if listfile is - for standard input\n\
+\t-m merges the reports output by running each shard with -l\n\
+\t-h prints this message\n\
+For example, run flex2sr -l list.N >report.N on each node, then merge.\n\
+", cmd, cmd);
+  exit(EXIT_FAILURE);
+}
+
+/**
+ * @fn int main(int argc, char *argv[])
+ * @brief Main function
+ * @details Split a list or merge reports, according to the options
+ * @param argc Command-line argument count
+ * @param argv Command-line arguments
+ * @return Zero on success, non-zero on error
+ */
+int main(int argc, char *argv[])
+{
+  int opt, nshards = 0, merging = 0, result;
+  char *prefix = NULL;
+
+  while ((opt = getopt(argc, argv, "n:o:mh")) != -1) {
+    switch (opt) {
+      case 'n': // Number of shards
+        nshards = atoi(optarg);
+        if (nshards < 1) usage(argv[0]);
+        break;
+      case 'o': // Shard filename prefix
+        prefix = optarg;
+        break;
+
+      case 'm': // Merge reports
+        merging = 1;
+        break;
+
+      case 'h': // Help/usage
+      case '?':
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  if (merging) {
+    if (nshards || prefix || optind == argc) usage(argv[0]);
+    result = merge(argc - optind, argv + optind);
+  } else {
+    if (!nshards || argc - optind != 1) usage(argv[0]);
+    if (prefix == NULL) prefix = argv[optind];
+    if (!strcmp("-", prefix)) usage(argv[0]);
+    result = split(argv[optind], prefix, nshards);
+  }
+  return result ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,377 @@
+/**
+ * @file flexsync.c
+ * @brief Host directory to FLEX disk image synchroniser
+ * @details
+ *   See ./flexsync -h for usage
+ *   Only files whose contents have changed since the last sync, or whose
+ *   directory entries no longer match, are rewritten. Content hashes are
+ *   kept in a sidecar file next to the image (image name plus .sync).
+ *   Files are copied verbatim, without text file conversion.
+ * @author David Knoll <david@davidknoll.me.uk>
+ * @copyright MIT License
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "flexdisk.h"
+
+/**
+ * @struct syncent
+ * @brief One file's record in the sidecar, with its state on the last sync.
+ */
+struct syncent {
+  char name[13];            ///< NAME.EXT
+  unsigned long long hash;  ///< FNV-1a hash of the contents
+  int strk, ssec, size;     ///< Start track/sector and sector count on the disk
+  int seen;                 ///< Host files found with this name this time
+};
+
+struct flexdisk disk;
+struct blockmap blocks = { SECSIZE, 1, 0 };
+struct syncent *cache = NULL;
+int ncache = 0, delete = 0, dryrun = 0, verbose = 0;
+
+/**
+ * @fn struct syncent *cachefind(const char *name)
+ * @brief Finds a file in the sidecar cache, adding it if not present.
+ * @param name NAME.EXT
+ * @return Cache entry, or NULL if out of memory.
+ */
+struct syncent *cachefind(const char *name)
+{
+  struct syncent *p;
+  int i;
+
+  for (i = 0; i < ncache; i++) {
+    if (!strcmp(cache[i].name, name)) return &cache[i];
+  }
+  p = realloc(cache, (ncache + 1) * sizeof(*cache));
+  if (p == NULL) return NULL;
+  cache = p;
+  p = &cache[ncache++];
+  memset(p, 0, sizeof(*p));
+  strcpy(p->name, name);
+  p->strk = -1;
+  return p;
+}
+
+/**
+ * @fn void cacheload(const char *sidename)
+ * @brief Loads the sidecar file, if there is one.
+ * @param sidename Sidecar filename.
+ */
+void cacheload(const char *sidename)
+{
+  FILE *f = fopen(sidename, "rt");
+  struct syncent e, *p;
+
+  if (f == NULL) return;
+  while (fscanf(f, "%12s %llx %d %d %d", e.name, &e.hash, &e.strk, &e.ssec, &e.size) == 5) {
+    p = cachefind(e.name);
+    if (p == NULL) break;
+    *p = e;
+    p->seen = 0;
+  }
+  fclose(f);
+}
+
+/**
+ * @fn int cachesave(const char *sidename)
+ * @brief Writes the sidecar file. Entries with no start track are left out.
+ * @param sidename Sidecar filename.
+ * @return Zero on success, -1 on error.
+ */
+int cachesave(const char *sidename)
+{
+  FILE *f = fopen(sidename, "wt");
+  int i;
+
+  if (f == NULL) return -1;
+  for (i = 0; i < ncache; i++) {
+    if (cache[i].strk < 0) continue;
+    fprintf(f, "%s %016llx %d %d %d\n", cache[i].name, cache[i].hash,
+      cache[i].strk, cache[i].ssec, cache[i].size);
+  }
+  return fclose(f) ? -1 : 0;
+}
+
+/**
+ * @fn int release(unsigned char *ent)
+ * @brief Returns a file's sectors to the free chain and marks its entry deleted.
+ * @details The caller writes the directory sector back.
+ * @param ent Directory entry.
+ * @return Zero on success, -1 on error.
+ */
+int release(unsigned char *ent)
+{
+  if (freechain(&disk, ent[ENT_START], ent[ENT_START + 1], ent[ENT_END], ent[ENT_END + 1],
+      (ent[ENT_SIZE] << 8) | ent[ENT_SIZE + 1])) return -1;
+  ent[ENT_NAME] = 0xFF;
+  return 0;
+}
+
+/**
+ * @fn int syncfile(const char *path, const char *name, const struct stat *st)
+ * @brief Brings one file on the disk up to date with the host file, if needed.
+ * @param path Host pathname.
+ * @param name 11-byte FLEX name and extension, as from flexname().
+ * @param st Host file status.
+ * @return Zero on success, -1 on error.
+ */
+int syncfile(const char *path, const char *name, const struct stat *st)
+{
+  static unsigned char *data = NULL;
+  static long datasize = 0;
+  unsigned char buf[SECSIZE], *ent, *p;
+  unsigned long long h;
+  struct syncent *c;
+  struct tm *tm;
+  char str[13];
+  int trk, sec, idx, found;
+  long count;
+  FILE *f;
+
+  // Read the whole host file
+  if (st->st_size > datasize) {
+    p = realloc(data, st->st_size);
+    if (p == NULL) return -1;
+    data = p;
+    datasize = st->st_size;
+  }
+  f = fopen(path, "rb");
+  if (f == NULL) return -1;
+  if (st->st_size && fread(data, st->st_size, 1, f) != 1) {
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+  h = fnvhash(data, st->st_size, FNV_INIT);
+
+  // Unchanged if the hash matches and the entry is where we left it
+  memcpy(buf, name, 11);
+  namestr(buf, str);
+  c = cachefind(str);
+  if (c == NULL) return -1;
+  found = dirfind(&disk, name, &trk, &sec, &idx, buf);
+  if (found < 0) return -1;
+  if (found) {
+    ent = buf + DIR_FIRST + idx * DIR_ENTSIZE;
+    if (c->hash == h && c->strk == ent[ENT_START] && c->ssec == ent[ENT_START + 1] &&
+        c->size == ((ent[ENT_SIZE] << 8) | ent[ENT_SIZE + 1])) return 0;
+  }
+
+  // Keep the old contents if the new ones would not fit even without them
+  if (found) {
+    count = (st->st_size + DATASIZE - 1) / DATASIZE;
+    if (count == 0) count = 1;
+    if (count > freecount(&disk) + ((ent[ENT_SIZE] << 8) | ent[ENT_SIZE + 1])) {
+      fprintf(stderr, "Disk full writing %s, old version kept\n", str);
+      return -1;
+    }
+  }
+
+  if (verbose || dryrun) printf("%s %s\n", found ? "update" : "add", str);
+  if (dryrun) return 0;
+
+  // Release the old contents, reusing the entry, or find a new entry
+  if (found) {
+    if (release(ent)) return -1;
+  } else {
+    if (dirslot(&disk, &trk, &sec, &idx, buf)) return -1;
+    ent = buf + DIR_FIRST + idx * DIR_ENTSIZE;
+  }
+
+  memset(ent, 0, DIR_ENTSIZE);
+  memcpy(ent + ENT_NAME, name, 11);
+  if (writefile(&disk, data, st->st_size, ent)) {
+    fprintf(stderr, "Disk full writing %s\n", str);
+    // Leave the entry deleted, its old sectors are already free
+    ent[ENT_NAME] = 0xFF;
+    diskwrite(&disk, trk, sec, buf);
+    c->strk = -1;
+    return -1;
+  }
+  tm = localtime(&st->st_mtime);
+  ent[ENT_DATE] = tm->tm_mon + 1;
+  ent[ENT_DATE + 1] = tm->tm_mday;
+  ent[ENT_DATE + 2] = tm->tm_year % 100;
+  if (diskwrite(&disk, trk, sec, buf)) return -1;
+
+  c->hash = h;
+  c->strk = ent[ENT_START];
+  c->ssec = ent[ENT_START + 1];
+  c->size = (ent[ENT_SIZE] << 8) | ent[ENT_SIZE + 1];
+  return 0;
+}
+
+/**
+ * @fn int prune(void)
+ * @brief Deletes files on the disk which were not found in the host directory.
+ * @return Zero on success, -1 on error.
+ */
+int prune(void)
+{
+  unsigned char buf[SECSIZE], *ent;
+  struct syncent *c;
+  char str[13];
+  int trk, sec, idx = -1, result;
+
+  while ((result = dirnext(&disk, &trk, &sec, &idx, buf)) == 1) {
+    ent = buf + DIR_FIRST + idx * DIR_ENTSIZE;
+    if (ent[ENT_NAME] == 0) break;
+    if (ent[ENT_NAME] & 0x80) continue;
+    namestr(ent, str);
+    c = cachefind(str);
+    if (c == NULL) return -1;
+    if (c->seen) continue;
+
+    if (verbose || dryrun) printf("delete %s\n", str);
+    if (dryrun) continue;
+    if (release(ent) || diskwrite(&disk, trk, sec, buf)) return -1;
+    c->strk = -1;
+  }
+  return result < 0 ? -1 : 0;
+}
+
+/**
+ * @fn void usage(const char *cmd)
+ * @brief Outputs help for the command.
+ * @param cmd Name of the program file, most likely from argv[0].
+ */
+void usage(const char *cmd)
+{
+  fprintf(stderr, "\
+Host directory to FLEX disk image synchroniser\n\
+Usage: %s [-b blocks] [-d] [-n] [-v] [-h] image directory\n\
+\t-b is the physical block layout, as for mkflexfs\n\
+\t-d deletes files from the image which are not in the directory\n\
+\t-n lists what would be done without changing the image\n\
+\t-v lists files added, updated and deleted\n\
+\t-h prints this message\n\
+Host files without a valid FLEX name are ignored, and those whose\n\
+names differ only in case are reported and left unsynced.\n\
+Content hashes are kept in image.sync alongside the image.\n\
+", cmd);
+  exit(EXIT_FAILURE);
+}
+
+/**
+ * @fn int main(int argc, char *argv[])
+ * @brief Main function
+ * @details Open the image, go through the host directory, save the sidecar
+ * @param argc Command-line argument count
+ * @param argv Command-line arguments
+ * @return Zero on success, non-zero on error
+ */
+int main(int argc, char *argv[])
+{
+  int opt, result = EXIT_SUCCESS, clashes = 0, n, i;
+  char name[11], str[13], *path, *sidename;
+  struct dirent **list;
+  struct syncent *c;
+  struct stat st;
+
+  while ((opt = getopt(argc, argv, "b:dnvh")) != -1) {
+    switch (opt) {
+      case 'b': // Physical block layout
+        if (parseblocks(optarg, &blocks)) usage(argv[0]);
+        break;
+      case 'd': // Delete files not in the host directory
+        delete = 1;
+        break;
+      case 'n': // Dry run
+        dryrun = 1;
+        break;
+      case 'v': // Verbose
+        verbose = 1;
+        break;
+
+      case 'h': // Help/usage
+      case '?':
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (argc - optind != 2) usage(argv[0]);
+
+  if (diskopen(&disk, argv[optind], dryrun ? "rb" : "r+b", &blocks)) {
+    fprintf(stderr, "Error opening image %s, errno %d\n", argv[optind], errno);
+    return EXIT_FAILURE;
+  }
+  // Sorted, so the result does not depend on the host directory order
+  n = scandir(argv[optind + 1], &list, NULL, alphasort);
+  if (n < 0) {
+    fprintf(stderr, "Error opening directory %s, errno %d\n", argv[optind + 1], errno);
+    diskclose(&disk);
+    return EXIT_FAILURE;
+  }
+  sidename = malloc(strlen(argv[optind]) + 6);
+  path = malloc(strlen(argv[optind + 1]) + 258);
+  if (sidename == NULL || path == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return EXIT_FAILURE;
+  }
+  sprintf(sidename, "%s.sync", argv[optind]);
+  cacheload(sidename);
+
+  // Count the host files for each FLEX name, names differing only in case clash
+  for (i = 0; i < n; i++) {
+    sprintf(path, "%s/%s", argv[optind + 1], list[i]->d_name);
+    if (flexname(list[i]->d_name, name) || stat(path, &st) || !S_ISREG(st.st_mode)) {
+      free(list[i]);
+      list[i] = NULL;
+      continue;
+    }
+    namestr((unsigned char *) name, str);
+    c = cachefind(str);
+    if (c == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      return EXIT_FAILURE;
+    }
+    c->seen++;
+  }
+
+  // Update each host file with a valid FLEX name of its own
+  for (i = 0; i < n; i++) {
+    if (list[i] == NULL) continue;
+    sprintf(path, "%s/%s", argv[optind + 1], list[i]->d_name);
+    flexname(list[i]->d_name, name);
+    namestr((unsigned char *) name, str);
+    if (cachefind(str)->seen > 1) {
+      fprintf(stderr, "Skipping %s, other host files are also %s\n", path, str);
+      clashes++;
+      continue;
+    }
+    if (stat(path, &st) || syncfile(path, name, &st)) {
+      fprintf(stderr, "Error syncing %s\n", path);
+      result = EXIT_FAILURE;
+      break;
+    }
+  }
+  for (i = 0; i < n; i++) free(list[i]);
+  free(list);
+
+  if (result == EXIT_SUCCESS && delete && prune()) {
+    fprintf(stderr, "Error deleting files from image\n");
+    result = EXIT_FAILURE;
+  }
+  if (clashes) result = EXIT_FAILURE;
+
+  // Write back the SIR even after an error, as sectors may have moved
+  if (!dryrun) {
+    if (disksync(&disk) || cachesave(sidename)) {
+      fprintf(stderr, "Error updating image %s\n", argv[optind]);
+      result = EXIT_FAILURE;
+    }
+  }
+  diskclose(&disk);
+  free(sidename);
+  free(path);
+  free(cache);
+  return result;
+}
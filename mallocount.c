@@ -0,0 +1,64 @@
+/**
+ * @file mallocount.c
+ * @brief Allocation counter for make check
+ * @details
+ *   Preloaded with LD_PRELOAD, counts calls to malloc, calloc and realloc,
+ *   and writes the count to the file named by MALLOCOUNT on exit.
+ *   Used by checkalloc.sh to check batch mode allocates the same for
+ *   any number of files.
+ * @author David Knoll <david@davidknoll.me.uk>
+ * @copyright MIT License
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static long count = 0;
+static void *(*realmalloc)(size_t);
+static void *(*realcalloc)(size_t, size_t);
+static void *(*realrealloc)(void *, size_t);
+
+void *malloc(size_t size)
+{
+  if (realmalloc == NULL) realmalloc = dlsym(RTLD_NEXT, "malloc");
+  count++;
+  return realmalloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+  // dlsym() may itself call calloc() before the real one is known
+  static char early[4096];
+  static int used = 0;
+
+  if (realcalloc == NULL) {
+    if (used) return NULL;
+    used = 1;
+    return early;
+  }
+  count++;
+  return realcalloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+  if (realrealloc == NULL) realrealloc = dlsym(RTLD_NEXT, "realloc");
+  count++;
+  return realrealloc(p, size);
+}
+
+__attribute__((constructor)) static void init(void)
+{
+  realcalloc = dlsym(RTLD_NEXT, "calloc");
+}
+
+__attribute__((destructor)) static void report(void)
+{
+  const char *name = getenv("MALLOCOUNT");
+  FILE *f;
+
+  if (name == NULL || (f = fopen(name, "wt")) == NULL) return;
+  fprintf(f, "%ld\n", count);
+  fclose(f);
+}
@@ -0,0 +1,283 @@
+/**
+ * @file memmap.c
+ * @brief Sparse memory image for 32-bit address spaces
+ * @details
+ *   Addresses are split into four bytes. The top three index a three-level
+ *   radix tree of tables leading to a page, the bottom byte indexes
+ *   the page itself. Pages and tables are allocated in blocks and
+ *   recycled through free lists.
+ * @author David Knoll <david@davidknoll.me.uk>
+ * @copyright MIT License
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "memmap.h"
+
+// Number of pages or tables allocated at a time
+#define PAGECHUNK  64
+#define TABLECHUNK 16
+
+/**
+ * @fn void *chunk(struct memmap *m, size_t size)
+ * @brief Allocates a block of memory, remembering it for memfree().
+ * @param m Memory image.
+ * @param size Size required.
+ * @return Pointer to the block, or NULL if out of memory.
+ */
+static void *chunk(struct memmap *m, size_t size)
+{
+  void **block = malloc(sizeof(void *) + size);
+  if (block == NULL) return NULL;
+  *block = m->chunks;
+  m->chunks = block;
+  return block + 1;
+}
+
+/**
+ * @fn struct mempage *newpage(struct memmap *m)
+ * @brief Takes an empty page from the free list, refilling it if necessary.
+ * @param m Memory image.
+ * @return Page, or NULL if out of memory.
+ */
+static struct mempage *newpage(struct memmap *m)
+{
+  struct mempage *p;
+  int i;
+
+  if (m->freepages == NULL) {
+    p = chunk(m, PAGECHUNK * sizeof(struct mempage));
+    if (p == NULL) return NULL;
+    for (i = 0; i < PAGECHUNK; i++) {
+      p[i].next = m->freepages;
+      m->freepages = &p[i];
+    }
+  }
+  p = m->freepages;
+  m->freepages = p->next;
+  memset(p->used, 0, sizeof(p->used));
+  p->next = m->pages;
+  m->pages = p;
+  return p;
+}
+
+/**
+ * @fn struct memtable *newtable(struct memmap *m)
+ * @brief Takes an empty table from the free list, refilling it if necessary.
+ * @param m Memory image.
+ * @return Table, or NULL if out of memory.
+ */
+static struct memtable *newtable(struct memmap *m)
+{
+  struct memtable *t;
+  int i;
+
+  if (m->freetables == NULL) {
+    t = chunk(m, TABLECHUNK * sizeof(struct memtable));
+    if (t == NULL) return NULL;
+    for (i = 0; i < TABLECHUNK; i++) {
+      t[i].next = m->freetables;
+      m->freetables = &t[i];
+    }
+  }
+  t = m->freetables;
+  m->freetables = t->next;
+  memset(t->entry, 0, sizeof(t->entry));
+  t->next = m->tables;
+  m->tables = t;
+  return t;
+}
+
+/**
+ * @fn const struct mempage *findpage(const struct memmap *m, unsigned long addr, unsigned long *step)
+ * @brief Finds the page containing an address, without creating it.
+ * @param m Memory image.
+ * @param addr Address.
+ * @param step If there is no page, set to the size of the empty region
+ *   (page, or table at whichever level was missing) containing the address.
+ * @return Page, or NULL if not present.
+ */
+static const struct mempage *findpage(const struct memmap *m, unsigned long addr, unsigned long *step)
+{
+  const struct memtable *t = m->top;
+  int shift;
+
+  for (shift = 24; shift >= 8; shift -= 8) {
+    if (t == NULL) {
+      *step = 1UL << (shift + 8);
+      return NULL;
+    }
+    t = t->entry[(addr >> shift) & 0xFF];
+  }
+  *step = PAGESIZE;
+  return (const struct mempage *) t;
+}
+
+/**
+ * @fn void meminit(struct memmap *m)
+ * @brief Initialises an empty memory image.
+ * @param m Memory image.
+ */
+void meminit(struct memmap *m)
+{
+  memset(m, 0, sizeof(*m));
+}
+
+/**
+ * @fn void memclear(struct memmap *m)
+ * @brief Empties a memory image, keeping its pages and tables for reuse.
+ * @param m Memory image.
+ */
+void memclear(struct memmap *m)
+{
+  struct mempage *p;
+  struct memtable *t;
+
+  while ((p = m->pages) != NULL) {
+    m->pages = p->next;
+    p->next = m->freepages;
+    m->freepages = p;
+  }
+  while ((t = m->tables) != NULL) {
+    m->tables = t->next;
+    t->next = m->freetables;
+    m->freetables = t;
+  }
+  m->top = NULL;
+  m->lastpage = NULL;
+}
+
+/**
+ * @fn void memfree(struct memmap *m)
+ * @brief Frees all memory used by a memory image, leaving it empty.
+ * @param m Memory image.
+ */
+void memfree(struct memmap *m)
+{
+  void **block;
+
+  while ((block = m->chunks) != NULL) {
+    m->chunks = *block;
+    free(block);
+  }
+  meminit(m);
+}
+
+/**
+ * @fn int memput(struct memmap *m, unsigned long addr, int c)
+ * @brief Writes one byte to a memory image.
+ * @param m Memory image.
+ * @param addr Address, 32 bits.
+ * @param c Byte to write.
+ * @return Zero on success, -1 if out of memory.
+ */
+int memput(struct memmap *m, unsigned long addr, int c)
+{
+  struct memtable *t;
+  struct mempage *p;
+  void **entry;
+  int shift;
+
+  addr &= 0xFFFFFFFFUL;
+  p = m->lastpage;
+  if (p == NULL || (addr & ~0xFFUL) != m->lastbase) {
+    // Walk down the tree, creating tables and the page as needed
+    if (m->top == NULL && (m->top = newtable(m)) == NULL) return -1;
+    t = m->top;
+    for (shift = 24; shift > 8; shift -= 8) {
+      entry = &t->entry[(addr >> shift) & 0xFF];
+      if (*entry == NULL && (*entry = newtable(m)) == NULL) return -1;
+      t = *entry;
+    }
+    entry = &t->entry[(addr >> 8) & 0xFF];
+    if (*entry == NULL && (*entry = newpage(m)) == NULL) return -1;
+    p = *entry;
+    m->lastpage = p;
+    m->lastbase = addr & ~0xFFUL;
+  }
+
+  p->data[addr & 0xFF] = c;
+  p->used[(addr & 0xFF) >> 3] |= 1 << (addr & 7);
+  return 0;
+}
+
+/**
+ * @fn int memget(const struct memmap *m, unsigned long addr)
+ * @brief Reads one byte from a memory image.
+ * @param m Memory image.
+ * @param addr Address, 32 bits.
+ * @return The byte, or -1 if it has not been written.
+ */
+int memget(const struct memmap *m, unsigned long addr)
+{
+  const struct mempage *p;
+  unsigned long step;
+
+  p = findpage(m, addr & 0xFFFFFFFFUL, &step);
+  if (p == NULL || !(p->used[(addr & 0xFF) >> 3] & (1 << (addr & 7)))) return -1;
+  return p->data[addr & 0xFF];
+}
+
+/**
+ * @fn int memrun(const struct memmap *m, unsigned long *addr, unsigned long *len)
+ * @brief Finds the next run of written bytes, in address order.
+ * @details
+ *   Empty tables and pages are skipped without visiting their contents.
+ *   To iterate over all runs, start with *addr zero and add *len to
+ *   *addr after each call.
+ * @param m Memory image.
+ * @param addr Address to search from, set to the start of the run found.
+ * @param len Set to the length of the run found.
+ * @return 1 if a run was found, 0 if no bytes are written at or above *addr.
+ */
+int memrun(const struct memmap *m, unsigned long *addr, unsigned long *len)
+{
+  const struct mempage *p;
+  unsigned long a = *addr & 0xFFFFFFFFUL, base, step, start;
+  int i;
+
+  if (m->top == NULL) return 0;
+
+  // Find the first written byte
+  for (;;) {
+    p = findpage(m, a, &step);
+    if (p != NULL) {
+      for (i = a & 0xFF; i < PAGESIZE; i++) {
+        if (!(i & 7) && !p->used[i >> 3]) {
+          i += 7;
+        } else if (p->used[i >> 3] & (1 << (i & 7))) {
+          break;
+        }
+      }
+      if (i < PAGESIZE) break;
+    }
+    base = (a & ~(step - 1)) + step;
+    if (base <= a || base > 0xFFFFFFFFUL) return 0;
+    a = base;
+  }
+  start = (a & ~0xFFUL) + i;
+  a = start;
+
+  // Follow it until the first unwritten byte
+  for (;;) {
+    base = a & ~0xFFUL;
+    for (i = a & 0xFF; i < PAGESIZE; i++) {
+      if (!(i & 7) && p->used[i >> 3] == 0xFF) {
+        i += 7;
+      } else if (!(p->used[i >> 3] & (1 << (i & 7)))) {
+        break;
+      }
+    }
+    if (i < PAGESIZE || base == 0xFFFFFF00UL) break;
+    a = base + PAGESIZE;
+    p = findpage(m, a, &step);
+    if (p == NULL) {
+      i = PAGESIZE;
+      break;
+    }
+    i = 0;
+  }
+
+  *addr = start;
+  *len = base - start + i;
+  return 1;
+}
@@ -0,0 +1,58 @@
+/**
+ * @file memmap.h
+ * @brief Sparse memory image for 32-bit address spaces
+ * @details
+ *   A radix tree of 256-byte pages, each with a bitmap of which bytes
+ *   have been written, so that S-record data with 16, 24 or 32-bit
+ *   addresses can be merged and then read back as contiguous runs.
+ * @author David Knoll <david@davidknoll.me.uk>
+ * @copyright MIT License
+ */
+#ifndef MEMMAP_H
+#define MEMMAP_H
+
+#define PAGESIZE 256
+
+/**
+ * @struct mempage
+ * @brief One page of memory and its coverage bitmap.
+ */
+struct mempage {
+  unsigned char data[PAGESIZE];     ///< Contents
+  unsigned char used[PAGESIZE / 8]; ///< Bit set for each byte written
+  struct mempage *next;             ///< Allocated or free list
+};
+
+/**
+ * @struct memtable
+ * @brief One level of the radix tree, indexed by one byte of the address.
+ */
+struct memtable {
+  void *entry[256];       ///< Next level table, or page at the bottom level
+  struct memtable *next;  ///< Allocated or free list
+};
+
+/**
+ * @struct memmap
+ * @brief A sparse memory image.
+ * @details
+ *   Pages and tables are kept on free lists when the image is cleared,
+ *   so that reusing it for another file does not go back to malloc.
+ */
+struct memmap {
+  struct memtable *top;                   ///< Indexed by address bits 31-24
+  struct mempage *pages, *freepages;      ///< Pages in use, pages to reuse
+  struct memtable *tables, *freetables;   ///< Tables in use, tables to reuse
+  void *chunks;                           ///< Blocks allocated, for memfree()
+  unsigned long lastbase;                 ///< Address of the last page written
+  struct mempage *lastpage;               ///< Last page written
+};
+
+void meminit(struct memmap *m);
+void memclear(struct memmap *m);
+void memfree(struct memmap *m);
+int memput(struct memmap *m, unsigned long addr, int c);
+int memget(const struct memmap *m, unsigned long addr);
+int memrun(const struct memmap *m, unsigned long *addr, unsigned long *len);
+
+#endif
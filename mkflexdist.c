@@ -0,0 +1,391 @@
+/**
+ * @file mkflexdist.c
+ * @brief FLEX distribution disk set builder
+ * @details
+ *   See ./mkflexdist -h for usage
+ *   Builds a set of FLEX disk images described by a manifest.
+ *   Each source file is read and encoded once however many images
+ *   it appears on, then the images are laid out in memory in parallel,
+ *   each file in contiguous sectors, and written out whole.
+ * @author David Knoll <david@davidknoll.me.uk>
+ * @copyright MIT License
+ */
+#include <errno.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "flexdisk.h"
+#include "flexpool.h"
+
+#define HASHSIZE 1024
+
+/**
+ * @struct source
+ * @brief A host file, read and encoded once.
+ */
+struct source {
+  char *path;             ///< Host pathname
+  int text;               ///< Converted to a FLEX text file
+  unsigned char *data;    ///< Encoded contents
+  long len;               ///< Length of encoded contents
+  time_t mtime;           ///< Modification time, for the directory date
+  struct source *next;    ///< Next in hash chain
+};
+
+/**
+ * @struct member
+ * @brief A file on an image.
+ */
+struct member {
+  struct source *src;     ///< Contents
+  char name[11];          ///< FLEX name and extension, as from flexname()
+};
+
+/**
+ * @struct image
+ * @brief An image to be built.
+ */
+struct image {
+  char *name;                     ///< Output filename
+  int tracks, sectors, volnum;    ///< Geometry and volume number, as for mkflexfs
+  char *volname;                  ///< Volume name
+  struct blockmap blocks;         ///< Physical block layout
+  struct member *files;           ///< Files on the image, in directory order
+  int nfiles;                     ///< Number of files
+};
+
+struct source *sources[HASHSIZE];
+struct image *images = NULL;
+int nimages = 0;
+
+/**
+ * @fn long encodetext(const unsigned char *in, long len, unsigned char *out)
+ * @brief Converts a host text file to FLEX conventions.
+ * @details
+ *   Line endings become CR. Host tabs are expanded to spaces at 8-column
+ *   stops, since in FLEX a TAB starts a compressed run, then runs of three
+ *   or more spaces are compressed to a TAB followed by the count, as FLEX
+ *   does. A tab expanding to two spaces makes the output longer, so it
+ *   may be up to twice as long as the input.
+ * @param in Host file contents.
+ * @param len Length of host file contents.
+ * @param out Buffer of at least 2 * len bytes for the FLEX file contents.
+ * @return Length of FLEX file contents.
+ */
+long encodetext(const unsigned char *in, long len, unsigned char *out)
+{
+  unsigned char *p = out;
+  long i, run, n, col = 0;
+
+  for (i = 0; i < len; i++) {
+    if (in[i] == '\r' && i + 1 < len && in[i + 1] == '\n') {
+      continue;
+    } else if (in[i] == '\n') {
+      *p++ = '\r';
+      col = 0;
+    } else if (in[i] == ' ' || in[i] == '\t') {
+      // Count the whole run of spaces with tabs expanded
+      for (run = 0; i < len && (in[i] == ' ' || in[i] == '\t'); i++) {
+        run += (in[i] == '\t') ? 8 - (col + run) % 8 : 1;
+      }
+      i--;
+      col += run;
+      for (; run >= 3; run -= n) {
+        n = (run < 127) ? run : 127;
+        *p++ = 0x09;
+        *p++ = n;
+      }
+      for (; run > 0; run--) *p++ = ' ';
+    } else {
+      *p++ = in[i];
+      col = (in[i] == '\r') ? 0 : col + 1;
+    }
+  }
+  return p - out;
+}
+
+/**
+ * @fn struct source *getsource(const char *path, int text)
+ * @brief Finds a source file in the cache, reading and encoding it if not there.
+ * @param path Host pathname.
+ * @param text Non-zero to convert to a FLEX text file.
+ * @return Cache entry, or NULL on error.
+ */
+struct source *getsource(const char *path, int text)
+{
+  unsigned int h = text;
+  unsigned char *p;
+  const char *c;
+  struct source *s;
+  struct stat st;
+  FILE *f;
+
+  for (c = path; *c; c++) h = h * 31 + (unsigned char) *c;
+  for (s = sources[h % HASHSIZE]; s != NULL; s = s->next) {
+    if (s->text == text && !strcmp(s->path, path)) return s;
+  }
+
+  s = calloc(1, sizeof(*s));
+  if (s == NULL) return NULL;
+  s->path = strdup(path);
+  s->text = text;
+  f = fopen(path, "rb");
+  if (s->path == NULL || f == NULL || fstat(fileno(f), &st)) {
+    fprintf(stderr, "Error reading file %s, errno %d\n", path, errno);
+    if (f != NULL) fclose(f);
+    return NULL;
+  }
+  s->mtime = st.st_mtime;
+  s->len = st.st_size;
+  s->data = malloc(s->len ? s->len : 1);
+  if (s->data == NULL || (s->len && fread(s->data, s->len, 1, f) != 1)) {
+    fprintf(stderr, "Error reading file %s, errno %d\n", path, errno);
+    fclose(f);
+    return NULL;
+  }
+  fclose(f);
+  if (text) {
+    p = malloc(s->len ? 2 * s->len : 1);
+    if (p == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      return NULL;
+    }
+    s->len = encodetext(s->data, s->len, p);
+    free(s->data);
+    s->data = p;
+  }
+
+  s->next = sources[h % HASHSIZE];
+  sources[h % HASHSIZE] = s;
+  return s;
+}
+
+/**
+ * @fn int parseline(char *line)
+ * @brief Processes one line of the manifest.
+ * @param line Line, which is modified.
+ * @return Zero on success, -1 on error.
+ */
+int parseline(char *line)
+{
+  char *word, *arg, *flex;
+  struct image *img;
+  struct member *m;
+
+  word = strtok(line, " \t\r\n");
+  if (word == NULL || *word == '#') return 0;
+
+  if (!strcmp(word, "image")) {
+    img = realloc(images, (nimages + 1) * sizeof(*images));
+    if (img == NULL) return -1;
+    images = img;
+    img += nimages++;
+    memset(img, 0, sizeof(*img));
+    img->tracks = 77;
+    img->sectors = 15;
+    img->volname = "";
+    img->blocks.size = SECSIZE;
+    img->blocks.perblock = 1;
+    if ((word = strtok(NULL, " \t\r\n")) == NULL) return -1;
+    img->name = strdup(word);
+    while ((word = strtok(NULL, " \t\r\n")) != NULL) {
+      arg = strtok(NULL, " \t\r\n");
+      if (arg == NULL || word[0] != '-' || word[1] == '\0' || word[2] != '\0') return -1;
+      switch (word[1]) {
+        case 't': img->tracks = atoi(arg); break;
+        case 's': img->sectors = atoi(arg); break;
+        case 'n': img->volname = strdup(arg); break;
+        case 'v': img->volnum = atoi(arg); break;
+        case 'b': if (parseblocks(arg, &img->blocks)) return -1; break;
+        default: return -1;
+      }
+    }
+    if (img->name == NULL || img->volname == NULL || strlen(img->volname) > 11 ||
+        img->tracks < 2 || img->tracks > 256 || img->sectors < 5 || img->sectors > 255) return -1;
+    return 0;
+
+  } else if (!strcmp(word, "file") || !strcmp(word, "text")) {
+    if (nimages == 0 || (arg = strtok(NULL, " \t\r\n")) == NULL) return -1;
+    flex = strtok(NULL, " \t\r\n");
+    img = &images[nimages - 1];
+    m = realloc(img->files, (img->nfiles + 1) * sizeof(*m));
+    if (m == NULL) return -1;
+    img->files = m;
+    m += img->nfiles;
+    m->src = getsource(arg, word[0] == 't');
+    if (m->src == NULL || flexname(flex ? flex : basename(arg), m->name)) return -1;
+    img->nfiles++;
+    return 0;
+  }
+  return -1;
+}
+
+/**
+ * @fn int readmanifest(const char *name)
+ * @brief Reads the manifest, and all source files it refers to.
+ * @details
+ *   Each image starts with a line:
+ *     image filename [-t tracks] [-s sectors] [-n volname] [-v volnum] [-b blocks]
+ *   followed by a line for each file on it:
+ *     file path [FLEXNAME.EXT]
+ *     text path [FLEXNAME.EXT]
+ *   where text files are converted to FLEX conventions.
+ *   The FLEX name defaults to the host filename.
+ *   Blank lines and lines starting with # are skipped.
+ * @param name Manifest filename, or - for standard input.
+ * @return Zero on success, -1 on error.
+ */
+int readmanifest(const char *name)
+{
+  static char line[2 * FILENAME_MAX + 16];
+  int lineno = 0, result = 0;
+  FILE *f;
+
+  f = strcmp("-", name) ? fopen(name, "rt") : stdin;
+  if (f == NULL) {
+    fprintf(stderr, "Error opening file %s for input, errno %d\n", name, errno);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    lineno++;
+    if (parseline(line)) {
+      fprintf(stderr, "Error in manifest %s at line %d\n", name, lineno);
+      result = -1;
+      break;
+    }
+  }
+  if (f != stdin) fclose(f);
+  return result;
+}
+
+/**
+ * @fn int build(struct image *img)
+ * @brief Lays out one image in memory and writes it out.
+ * @details
+ *   Files are written in manifest order from the start of the fresh
+ *   free chain, so each occupies contiguous sectors.
+ * @param img Image to build.
+ * @return Zero on success, -1 on error.
+ */
+int build(struct image *img)
+{
+  unsigned char buf[SECSIZE], *ent;
+  struct flexdisk disk;
+  struct tm tm;
+  char str[13];
+  int i, trk, sec, idx;
+
+  if (diskcreate(&disk, img->tracks, img->sectors, img->volname, img->volnum)) {
+    fprintf(stderr, "Out of memory creating %s\n", img->name);
+    return -1;
+  }
+
+  for (i = 0; i < img->nfiles; i++) {
+    memcpy(buf, img->files[i].name, 11);
+    namestr(buf, str);
+    if (dirfind(&disk, img->files[i].name, &trk, &sec, &idx, buf) != 0) {
+      fprintf(stderr, "Duplicate file %s on %s\n", str, img->name);
+      diskclose(&disk);
+      return -1;
+    }
+    if (dirslot(&disk, &trk, &sec, &idx, buf)) {
+      fprintf(stderr, "Disk full adding %s to %s\n", str, img->name);
+      diskclose(&disk);
+      return -1;
+    }
+    ent = buf + DIR_FIRST + idx * DIR_ENTSIZE;
+    memset(ent, 0, DIR_ENTSIZE);
+    memcpy(ent + ENT_NAME, img->files[i].name, 11);
+    if (writefile(&disk, img->files[i].src->data, img->files[i].src->len, ent)) {
+      fprintf(stderr, "Disk full adding %s to %s\n", str, img->name);
+      diskclose(&disk);
+      return -1;
+    }
+    localtime_r(&img->files[i].src->mtime, &tm);
+    ent[ENT_DATE] = tm.tm_mon + 1;
+    ent[ENT_DATE + 1] = tm.tm_mday;
+    ent[ENT_DATE + 2] = tm.tm_year % 100;
+    diskwrite(&disk, trk, sec, buf);
+  }
+
+  disksync(&disk);
+  if (disksave(&disk, img->name, &img->blocks)) {
+    fprintf(stderr, "Error writing image %s, errno %d\n", img->name, errno);
+    diskclose(&disk);
+    return -1;
+  }
+  diskclose(&disk);
+  return 0;
+}
+
+/**
+ * @fn int buildjob(int i)
+ * @brief Builds one image, run by the worker threads.
+ * @param i Index into images.
+ * @return Zero on success, -1 on error.
+ */
+int buildjob(int i)
+{
+  return build(&images[i]);
+}
+
+/**
+ * @fn void usage(const char *cmd)
+ * @brief Outputs help for the command.
+ * @param cmd Name of the program file, most likely from argv[0].
+ */
+void usage(const char *cmd)
+{
+  fprintf(stderr, "\
+FLEX distribution disk set builder\n\
+Usage: %s [-j jobs] [-h] manifest\n\
+\t-j is the number of images built in parallel, default 1\n\
+\t-h prints this message\n\
+manifest may be -, and contains lines of the forms:\n\
+\timage filename [-t tracks] [-s sectors] [-n volname] [-v volnum] [-b blocks]\n\
+\tfile path [FLEXNAME.EXT]\n\
+\ttext path [FLEXNAME.EXT]\n\
+Image options are as for mkflexfs. Files are added to the image above,\n\
+text files are converted to FLEX line endings and space compression,\n\
+with tabs expanded to 8-column stops.\n\
+", cmd);
+  exit(EXIT_FAILURE);
+}
+
+/**
+ * @fn int main(int argc, char *argv[])
+ * @brief Main function
+ * @details Read the manifest and sources, then build images in parallel
+ * @param argc Command-line argument count
+ * @param argv Command-line arguments
+ * @return Zero on success, non-zero on error
+ */
+int main(int argc, char *argv[])
+{
+  int opt, jobs = 1, failed;
+
+  while ((opt = getopt(argc, argv, "j:h")) != -1) {
+    switch (opt) {
+      case 'j': // Parallel jobs
+        jobs = atoi(optarg);
+        if (jobs < 1) usage(argv[0]);
+        break;
+
+      case 'h': // Help/usage
+      case '?':
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (argc - optind != 1) usage(argv[0]);
+  if (readmanifest(argv[optind])) return EXIT_FAILURE;
+  if (nimages == 0) return EXIT_SUCCESS;
+
+  failed = runpool(jobs, nimages, buildjob);
+  if (failed < 0) fprintf(stderr, "Error creating thread\n");
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
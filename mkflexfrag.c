@@ -0,0 +1,286 @@
+/**
+ * @file mkflexfrag.c
+ * @brief FLEX fragmented disk image generator
+ * @details
+ *   See ./mkflexfrag -h for usage
+ *   Creates an image as mkflexfs would, then fills it with files in a
+ *   way that looks like years of use: the free chain is shuffled before
+ *   files are written, and some files are deleted again afterwards.
+ *   Everything, including dates and file contents, comes from the seed,
+ *   so the same options always give the same image.
+ * @author David Knoll <david@davidknoll.me.uk>
+ * @copyright MIT License
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "flexdisk.h"
+
+struct flexdisk disk;
+int tracks = 77, sectors = 15, volnum = 0;
+int nfiles = 100, mean = 8, frag = 50, deleted = 10, geometric = 0;
+unsigned long long seed = 1;
+char *volname = "";
+struct blockmap blocks = { SECSIZE, 1, 0 };
+
+/**
+ * @fn unsigned long rnd(unsigned long n)
+ * @brief Returns a pseudo-random number (xorshift64*), the same on every platform.
+ * @param n Upper limit, exclusive.
+ * @return Number from 0 to n-1.
+ */
+unsigned long rnd(unsigned long n)
+{
+  seed ^= seed >> 12;
+  seed ^= seed << 25;
+  seed ^= seed >> 27;
+  return ((seed * 0x2545F4914F6CDD1DULL) >> 32) % n;
+}
+
+/**
+ * @fn int shuffle(void)
+ * @brief Fragments the free chain.
+ * @details
+ *   Each sector in the chain is swapped with a random other one with
+ *   a probability of frag percent, then the chain is relinked in the
+ *   new order. At 0 the chain is left in mkflexfs order, at 100 files
+ *   written from it are scattered over the whole disk.
+ * @return Zero on success, -1 on error.
+ */
+int shuffle(void)
+{
+  unsigned char buf[SECSIZE], (*chain)[2], t[2];
+  int n = freecount(&disk), i, j;
+
+  if (n == 0) return 0;
+  chain = malloc(n * sizeof(*chain));
+  if (chain == NULL) return -1;
+
+  // Follow the chain as it is
+  chain[0][0] = disk.sir[SIR_FREESTART];
+  chain[0][1] = disk.sir[SIR_FREESTART + 1];
+  for (i = 1; i < n; i++) {
+    if (diskread(&disk, chain[i - 1][0], chain[i - 1][1], buf)) break;
+    chain[i][0] = buf[0];
+    chain[i][1] = buf[1];
+  }
+  if (i < n) {
+    free(chain);
+    return -1;
+  }
+
+  for (i = 0; i < n; i++) {
+    if (rnd(100) >= (unsigned long) frag) continue;
+    j = rnd(n);
+    memcpy(t, chain[i], 2);
+    memcpy(chain[i], chain[j], 2);
+    memcpy(chain[j], t, 2);
+  }
+
+  // Relink in the new order
+  for (i = 0; i < n; i++) {
+    if (diskread(&disk, chain[i][0], chain[i][1], buf)) break;
+    buf[0] = (i + 1 < n) ? chain[i + 1][0] : 0;
+    buf[1] = (i + 1 < n) ? chain[i + 1][1] : 0;
+    if (diskwrite(&disk, chain[i][0], chain[i][1], buf)) break;
+  }
+  if (i < n) {
+    free(chain);
+    return -1;
+  }
+  disk.sir[SIR_FREESTART] = chain[0][0];
+  disk.sir[SIR_FREESTART + 1] = chain[0][1];
+  disk.sir[SIR_FREEEND] = chain[n - 1][0];
+  disk.sir[SIR_FREEEND + 1] = chain[n - 1][1];
+  free(chain);
+  return 0;
+}
+
+/**
+ * @fn int addfiles(void)
+ * @brief Writes files of random size and contents until nfiles or the disk is full.
+ * @details
+ *   Sizes are spread evenly from 1 to 2 * mean - 1 sectors, or if
+ *   geometric is set, follow a geometric distribution with the same
+ *   mean, mostly small files with a long tail of large ones. The last
+ *   sector is partly used. Dates are spread over 1980 to 1989.
+ * @return Number of files written, or -1 on error.
+ */
+int addfiles(void)
+{
+  static unsigned char data[0xFFFF * DATASIZE];
+  unsigned char buf[SECSIZE], *ent;
+  char name[16];
+  int i, trk, sec, idx;
+  long len, j;
+
+  for (i = 0; i < nfiles; i++) {
+    if (geometric) {
+      // Each further sector with probability 1 - 1 / mean
+      for (len = 0; len < 0xFFFE && rnd(mean); len++);
+    } else {
+      len = rnd(2 * mean - 1);
+    }
+    len = len * DATASIZE + 1 + rnd(DATASIZE);
+    if ((len + DATASIZE - 1) / DATASIZE > freecount(&disk)) break;
+    for (j = 0; j < len; j++) data[j] = rnd(256);
+
+    if (dirslot(&disk, &trk, &sec, &idx, buf)) break;
+    ent = buf + DIR_FIRST + idx * DIR_ENTSIZE;
+    memset(ent, 0, DIR_ENTSIZE);
+    sprintf(name, "F%05d.DAT", i);
+    flexname(name, (char *) ent + ENT_NAME);
+    if (writefile(&disk, data, len, ent)) break;
+    ent[ENT_DATE] = 1 + rnd(12);
+    ent[ENT_DATE + 1] = 1 + rnd(28);
+    ent[ENT_DATE + 2] = 80 + rnd(10);
+    if (diskwrite(&disk, trk, sec, buf)) return -1;
+  }
+  return i;
+}
+
+/**
+ * @fn int delfiles(void)
+ * @brief Deletes a random deleted percent of the files, returning their chains to the free chain.
+ * @return Number of files deleted, or -1 on error.
+ */
+int delfiles(void)
+{
+  unsigned char buf[SECSIZE], *ent;
+  int trk, sec, idx = -1, result, count = 0;
+
+  while ((result = dirnext(&disk, &trk, &sec, &idx, buf)) == 1) {
+    ent = buf + DIR_FIRST + idx * DIR_ENTSIZE;
+    if (ent[ENT_NAME] == 0) break;
+    if (rnd(100) >= (unsigned long) deleted) continue;
+    if (freechain(&disk, ent[ENT_START], ent[ENT_START + 1], ent[ENT_END], ent[ENT_END + 1],
+        (ent[ENT_SIZE] << 8) | ent[ENT_SIZE + 1])) return -1;
+    ent[ENT_NAME] = 0xFF;
+    if (diskwrite(&disk, trk, sec, buf)) return -1;
+    count++;
+  }
+  return (result < 0) ? -1 : count;
+}
+
+/**
+ * @fn void usage(const char *cmd)
+ * @brief Outputs help for the command.
+ * @param cmd Name of the program file, most likely from argv[0].
+ */
+void usage(const char *cmd)
+{
+  fprintf(stderr, "\
+FLEX fragmented disk image generator\n\
+Usage: %s [-t tracks] [-s sectors] [-n volname] [-v volnum] [-b blocks]\n\
+          [-f files] [-m mean] [-z dist] [-F frag] [-d deleted] [-S seed] -o filename [-h]\n\
+\ttracks, sectors, volname, volnum and blocks are as for mkflexfs\n\
+\tfiles is the number of files to create, default 100\n\
+\tmean is the mean file size in sectors, default 8\n\
+\tdist is the file size distribution, uniform (default) from 1 to\n\
+\t  2 * mean - 1 sectors, or geometric, with a long tail of large files\n\
+\tfrag is the percentage of free chain sectors shuffled, default 50\n\
+\tdeleted is the percentage of files deleted afterwards, default 10\n\
+\tseed is an integer, default 1, the same seed gives the same image\n\
+\t-h prints this message\n\
+", cmd);
+  exit(EXIT_FAILURE);
+}
+
+/**
+ * @fn int main(int argc, char *argv[])
+ * @brief Main function
+ * @details Create the image in memory, fragment it and write it out
+ * @param argc Command-line argument count
+ * @param argv Command-line arguments
+ * @return Zero on success, non-zero on error
+ */
+int main(int argc, char *argv[])
+{
+  int opt, created;
+  char *outfilename = NULL;
+
+  while ((opt = getopt(argc, argv, "t:s:n:v:b:f:m:z:F:d:S:o:h")) != -1) {
+    switch (opt) {
+      case 't': // Tracks
+        tracks = atoi(optarg);
+        if (tracks < 2 || tracks > 256) usage(argv[0]);
+        break;
+      case 's': // Sectors
+        sectors = atoi(optarg);
+        if (sectors < 5 || sectors > 255) usage(argv[0]);
+        break;
+
+      case 'n': // Volume name
+        volname = optarg;
+        if (strlen(volname) > 11) usage(argv[0]);
+        break;
+      case 'v': // Volume number
+        volnum = atoi(optarg);
+        break;
+      case 'b': // Physical block layout
+        if (parseblocks(optarg, &blocks)) usage(argv[0]);
+        break;
+
+      case 'f': // Number of files
+        nfiles = atoi(optarg);
+        if (nfiles < 0 || nfiles > 99999) usage(argv[0]);
+        break;
+      case 'm': // Mean file size
+        mean = atoi(optarg);
+        if (mean < 1 || mean > 0x7FFF) usage(argv[0]);
+        break;
+      case 'z': // Size distribution
+        if (!strcmp(optarg, "geometric")) geometric = 1;
+        else if (!strcmp(optarg, "uniform")) geometric = 0;
+        else usage(argv[0]);
+        break;
+      case 'F': // Fragmentation
+        frag = atoi(optarg);
+        if (frag < 0 || frag > 100) usage(argv[0]);
+        break;
+      case 'd': // Deleted files
+        deleted = atoi(optarg);
+        if (deleted < 0 || deleted > 100) usage(argv[0]);
+        break;
+      case 'S': // Seed
+        seed = strtoull(optarg, NULL, 10);
+        if (seed == 0) usage(argv[0]);
+        break;
+
+      case 'o': // Output filename
+        outfilename = optarg;
+        break;
+
+      case 'h': // Help/usage
+      case '?':
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (outfilename == NULL || optind != argc) usage(argv[0]);
+
+  if (diskcreate(&disk, tracks, sectors, volname, volnum)) {
+    fprintf(stderr, "Out of memory\n");
+    return EXIT_FAILURE;
+  }
+  // Fixed initialisation date, so the image depends only on the options
+  disk.sir[SIR_DATE] = 1;
+  disk.sir[SIR_DATE + 1] = 1;
+  disk.sir[SIR_DATE + 2] = 80;
+
+  if (shuffle() || (created = addfiles()) < 0 || delfiles() < 0 || disksync(&disk)) {
+    fprintf(stderr, "Error generating image\n");
+    diskclose(&disk);
+    return EXIT_FAILURE;
+  }
+  if (created < nfiles) fprintf(stderr, "Disk full after %d files\n", created);
+  if (disksave(&disk, outfilename, &blocks)) {
+    fprintf(stderr, "Error writing image %s, errno %d\n", outfilename, errno);
+    diskclose(&disk);
+    return EXIT_FAILURE;
+  }
+  diskclose(&disk);
+  return EXIT_SUCCESS;
+}
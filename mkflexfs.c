@@ -10,102 +10,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
 #include <unistd.h>
+#include "flexdisk.h"
 
-FILE *outfile;
+struct flexdisk disk;
 int tracks = 77, sectors = 15, volnum = 0;
 char *volname = "";
-
-/**
- * @fn void outblank(int ltrk, int lsect)
- * @brief Outputs a blank sector with a link to the next in the chain.
- * @details Pass zero in both parameters to output a sector of all zeroes.
- * @param ltrk Track number of the next sector in the chain.
- * @param lsect Sector number of the next sector in the chain.
- */
-void outblank(int ltrk, int lsect)
-{
-  int i;
-  fputc(ltrk, outfile);
-  fputc(lsect, outfile);
-  for (i = 0; i < 254; i++) fputc(0, outfile);
-}
-
-/**
- * @fn void outsir(void)
- * @brief Outputs a System Information Record sector (track 0, sector 3).
- * @details
- *   Date is taken from the system date. Track and sector count,
- *   volume name and volume number are taken from the global variables.
- */
-void outsir(void)
-{
-  int i;
-  time_t rawtime;
-  struct tm *timeinfo;
-  // Zeroes
-  for (i = 0; i < 16; i++) fputc(0, outfile);
-
-  // Disk name, volume number
-  fputs(volname, outfile);
-  for (i = 0; i < 11 - strlen(volname); i++) fputc(0, outfile);
-  fputc(volnum >> 8, outfile);
-  fputc(volnum, outfile);
-
-  // Start, end, size of free chain
-  fputc(1, outfile);
-  fputc(1, outfile);
-  fputc(tracks - 1, outfile);
-  fputc(sectors, outfile);
-  fputc(((tracks - 1) * sectors) >> 8, outfile);
-  fputc(((tracks - 1) * sectors), outfile);
-
-  // Initialisation date (mm/dd/yy)
-  time(&rawtime);
-  timeinfo = localtime(&rawtime);
-  fputc(timeinfo->tm_mon + 1, outfile);
-  fputc(timeinfo->tm_mday, outfile);
-  fputc(timeinfo->tm_year % 100, outfile);
-
-  // Max track/sector number
-  fputc(tracks - 1, outfile);
-  fputc(sectors, outfile);
-
-  // Reserved
-  for (i = 0; i < 216; i++) fputc(0, outfile);
-}
-
-/**
- * @fn void outsector(int track, int sector)
- * @brief Outputs sector contents of the correct type for the specified sector.
- * @param track
- * @param sector
- */
-void outsector(int track, int sector)
-{
-  if (track == 0 && sector == 3) {
-    // System Information Record
-    outsir();
-
-  } else if (track == 0 && sector >= 5 && sector < sectors) {
-    // Directory chain
-    outblank(track, sector + 1);
-  } else if (track == 0) {
-    // Boot sector (1-2), reserved (4), or end of directory chain
-    outblank(0, 0);
-
-  } else if (track == tracks - 1 && sector == sectors) {
-    // End of free chain
-    outblank(0, 0);
-  } else if (sector == sectors) {
-    // End of track
-    outblank(track + 1, 1);
-  } else {
-    // Free chain
-    outblank(track, sector + 1);
-  }
-}
+struct blockmap blocks = { SECSIZE, 1, 0 };
 
 /**
  * @fn void usage(const char *cmd)
@@ -116,11 +27,14 @@ void usage(const char *cmd)
 {
   fprintf(stderr, "\
 FLEX blank disk image creator\n\
-Usage: %s [-t tracks] [-s sectors] [-n volname] [-v volnum] [-o filename] [-h]\n\
-\ttracks is an integer, default 77, min 2\n\
-\tsectors is an integer, default 15, min 5\n\
+Usage: %s [-t tracks] [-s sectors] [-n volname] [-v volnum] [-b blocks] [-o filename] [-h]\n\
+\ttracks is an integer, default 77, min 2, max 256\n\
+\tsectors is an integer, default 15, min 5, max 255\n\
 \tvolname is max 11 characters, default empty\n\
 \tvolnum is an integer, default 0\n\
+\tblocks is the physical block layout for CF/hard disks, default 256:\n\
+\t  size[,perblock][,t] packs perblock sectors, default as many as fit,\n\
+\t  into each block of size bytes, t starts each track on a new block\n\
 \tfilename may be (and defaults to) -, but won't output to the terminal\n\
 \t-h prints this message\n\
 ", cmd);
@@ -130,25 +44,26 @@ Usage: %s [-t tracks] [-s sectors] [-n volname] [-v volnum] [-o filename] [-h]\n
 /**
  * @fn int main(int argc, char *argv[])
  * @brief Main function
- * @details Open/close files and iterate through sectors to output
+ * @details Lay out the blank disk in memory and output it in the block layout
  * @param argc Command-line argument count
  * @param argv Command-line arguments
  * @return Zero on success, non-zero on error
  */
 int main(int argc, char *argv[])
 {
-  int opt, trk, sec;
+  int opt, result;
+  FILE *outfile;
   char *outfilename = "-";
 
-  while ((opt = getopt(argc, argv, "t:s:n:v:o:h")) != -1) {
+  while ((opt = getopt(argc, argv, "t:s:n:v:b:o:h")) != -1) {
     switch (opt) {
       case 't': // Tracks
         tracks = atoi(optarg);
-        if (tracks < 2) usage(argv[0]);
+        if (tracks < 2 || tracks > 256) usage(argv[0]);
         break;
       case 's': // Sectors
         sectors = atoi(optarg);
-        if (sectors < 5) usage(argv[0]);
+        if (sectors < 5 || sectors > 255) usage(argv[0]);
         break;
 
       case 'n': // Volume name
@@ -158,6 +73,9 @@ int main(int argc, char *argv[])
       case 'v': // Volume number
         volnum = atoi(optarg);
         break;
+      case 'b': // Physical block layout
+        if (parseblocks(optarg, &blocks)) usage(argv[0]);
+        break;
 
       case 'o': // Output filename
         outfilename = optarg;
@@ -183,12 +101,21 @@ int main(int argc, char *argv[])
     outfile = stdout;
   }
 
-  // Output each sector in turn
-  for (trk = 0; trk < tracks; trk++) {
-    for (sec = 1; sec <= sectors; sec++) {
-      outsector(trk, sec);
-    }
+  // Buffer whole blocks, so that devices only see whole block writes
+  if (blocks.size > SECSIZE) setvbuf(outfile, NULL, _IOFBF, blocks.size * 16);
+
+  // Output the sectors of the blank disk in the block layout
+  if (diskcreate(&disk, tracks, sectors, volname, volnum)) {
+    fprintf(stderr, "Out of memory\n");
+    return EXIT_FAILURE;
+  }
+  result = diskput(&disk, outfile, &blocks);
+  diskclose(&disk);
+  if (fflush(outfile)) result = -1;
+  if (outfile != stdout && fclose(outfile)) result = -1;
+  if (result) {
+    fprintf(stderr, "Error writing file %s, errno %d\n", outfilename, errno);
+    return EXIT_FAILURE;
   }
-  if (outfile != stdout) fclose(outfile);
   return EXIT_SUCCESS;
 }
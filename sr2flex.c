@@ -2,9 +2,10 @@
  * @file sr2flex.c
  * @brief Motorola S-record to FLEX binary converter
  * @details
- *   Usage: sr2flex infile outfile
+ *   See ./sr2flex -h for usage
  *   Output records are the same size as input records, so may not
- *   be as large as possible even where data is contiguous.
+ *   be as large as possible even where data is contiguous,
+ *   unless merging is requested.
  *   Output is not padded to a multiple of 252 bytes in size.
  * @author David Knoll <david@davidknoll.me.uk>
  * @copyright MIT License
@@ -12,6 +13,19 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "memmap.h"
+
+struct memmap mem;
+int merge = 0, window = 0, havestart = 0;
+unsigned long base = 0, startaddr;
+long insize;
+
+// Streams kept open between files in a batch, and their buffers
+FILE *instream = NULL, *outstream = NULL;
+char inbuf[BUFSIZ], outbuf[BUFSIZ], line[2 * FILENAME_MAX + 2];
 
 /**
  * @fn unsigned char finhn(FILE *f)
@@ -71,8 +85,12 @@ unsigned int finhw(FILE *f)
  * @details
  *   NUL/CR/LF between records are skipped over.
  *   Anything else between records is an error.
- *   S0/5 records are skipped over.
- *   Unrecognised, S2-3 or S7-8 records are considered an error.
+ *   S0/5/6 records are skipped over.
+ *   Addresses are taken relative to the window base. Data and start
+ *   addresses outside the 64K window are skipped if a window was given,
+ *   otherwise they are an error.
+ *   When merging, data and the start address are stored in the memory
+ *   image instead of being output, see flush().
  * @param infile Open file pointer to the input S-record file.
  * @param outfile Open file pointer to the output FLEX binary.
  * @return
@@ -80,13 +98,15 @@ unsigned int finhw(FILE *f)
  *   Most likely '0', '1', '5' or '9'.
  *   EOF if encountered.
  *   'S' if bad data between records.
- *   'R' if unrecognised or unacceptable record type.
+ *   'R' if unrecognised record type.
  *   'C' if recognised record type but bad checksum.
+ *   'A' if address outside the window.
+ *   'M' if out of memory while merging.
  */
 int record(FILE *infile, FILE *outfile)
 {
-  int rectype, nbytes, c;
-  unsigned int chksum, loadaddr;
+  int rectype, nbytes, addrlen, c;
+  unsigned long chksum, loadaddr, lo, hi;
 
   do { // S
     c = fgetc(infile);
@@ -97,96 +117,308 @@ int record(FILE *infile, FILE *outfile)
   } while (c != 'S');
 
   rectype = fgetc(infile); // 0-9
+  switch (rectype) {
+    case '0': case '1': case '5': case '9': addrlen = 2; break;
+    case '2': case '6': case '8': addrlen = 3; break;
+    case '3': case '7': addrlen = 4; break;
+    default: return 'R'; // Unrecognised record type
+  }
+
   c = finhb(infile); // Count
   chksum = c;
-  nbytes = c - 3;
-  loadaddr = finhw(infile); // Address
-  chksum += (loadaddr >> 8) & 0xFF;
-  chksum += loadaddr & 0xFF;
+  nbytes = c - 1 - addrlen;
+  loadaddr = 0;
+  while (addrlen--) { // Address
+    c = finhb(infile);
+    chksum += c;
+    loadaddr = (loadaddr << 8) | c;
+  }
   switch (rectype) {
 
     case '1': // Data
+    case '2':
+    case '3':
       if (!nbytes) break; // Skip empty records
-      fputc(0x02, outfile);
-      fputc((loadaddr >> 8) & 0xFF, outfile);
-      fputc(loadaddr & 0xFF, outfile);
-      fputc(nbytes, outfile);
+      if (merge) {
+        while (nbytes--) {
+          c = finhb(infile);
+          chksum += c;
+          if (memput(&mem, loadaddr++, c)) return 'M';
+        }
+        break;
+      }
+
+      // Output only the part of the record inside the window
+      lo = (loadaddr < base) ? base : loadaddr;
+      hi = (loadaddr + nbytes > base + 0x10000) ? base + 0x10000 : loadaddr + nbytes;
+      if (!window && (lo != loadaddr || hi != loadaddr + nbytes)) return 'A';
+      if (lo < hi) {
+        fputc(0x02, outfile);
+        fputc(((lo - base) >> 8) & 0xFF, outfile);
+        fputc((lo - base) & 0xFF, outfile);
+        fputc(hi - lo, outfile);
+      }
       // Loop over data bytes in the record
-      while (nbytes--) {
+      for (; nbytes--; loadaddr++) {
         c = finhb(infile);
         chksum += c;
-        fputc(c, outfile);
+        if (loadaddr >= lo && loadaddr < hi) fputc(c, outfile);
       }
       break;
 
-    case '9': // Start address
+    case '7': // Start address
+    case '8':
+    case '9':
       if (!loadaddr) break; // Skip null addresses
+      if (merge) {
+        startaddr = loadaddr;
+        havestart = 1;
+        break;
+      }
+      if (loadaddr < base || loadaddr - base > 0xFFFF) {
+        if (window) break;
+        return 'A';
+      }
       fputc(0x16, outfile);
-      fputc((loadaddr >> 8) & 0xFF, outfile);
-      fputc(loadaddr & 0xFF, outfile);
+      fputc(((loadaddr - base) >> 8) & 0xFF, outfile);
+      fputc((loadaddr - base) & 0xFF, outfile);
       break;
 
     case '0': // Header
     case '5': // Count
+    case '6':
       // Skip over, but update checksum anyway
       while (nbytes--) {
         c = finhb(infile);
         chksum += c;
       }
       break;
-
-    default: // Unrecognised or unacceptable record type
-      return 'R';
   }
   chksum += finhb(infile); // Checksum
-  if (chksum & 0xFF != 0xFF) return 'C';
+  if ((chksum & 0xFF) != 0xFF) return 'C';
   return rectype;
 }
 
 /**
- * @fn int main(int argc, char *argv[])
- * @brief Main function
- * @details Open/close files and go through records until EOF or error
- * @param argc Command-line argument count
- * @param argv Command-line arguments
- * @return Zero on success, non-zero on error
+ * @fn int flush(FILE *outfile)
+ * @brief Outputs the merged memory image as FLEX binary records.
+ * @details
+ *   Each contiguous run of data in the window is output in address order,
+ *   in records of up to 252 bytes as flex2sr can convert back, followed by
+ *   the last start address seen.
+ * @param outfile Open file pointer to the output FLEX binary.
+ * @return EOF on success, 'A' if there is data outside the 64K window and no window was given.
  */
-int main(int argc, char *argv[])
+int flush(FILE *outfile)
 {
-  FILE *infile, *outfile;
-  int rectype;
+  unsigned long addr = 0x10000, end = base + 0xFFFF, len, n;
 
-  if (argc != 3) {
-    fprintf(stderr, "\
-Motorola S-record to FLEX binary converter\n\
-Usage: %s infile outfile\n\
-Output records are the same size as input records, so may not\n\
-be as large as possible even where data is contiguous.\n\
-Output is not padded to a multiple of 252 bytes in size.\n\
-", argv[0]);
-    return EXIT_FAILURE;
+  if (!window && memrun(&mem, &addr, &len)) return 'A';
+  if (end > 0xFFFFFFFFUL) end = 0xFFFFFFFFUL;
+
+  addr = base;
+  while (memrun(&mem, &addr, &len) && addr <= end) {
+    if (len - 1 > end - addr) len = end - addr + 1;
+    while (len) {
+      n = (len > 0xFC) ? 0xFC : len;
+      fputc(0x02, outfile);
+      fputc(((addr - base) >> 8) & 0xFF, outfile);
+      fputc((addr - base) & 0xFF, outfile);
+      fputc(n, outfile);
+      len -= n;
+      while (n--) fputc(memget(&mem, addr++), outfile);
+    }
+    if (addr == 0 || addr > end) break;
+  }
+
+  if (havestart && startaddr >= base && startaddr <= end) {
+    fputc(0x16, outfile);
+    fputc(((startaddr - base) >> 8) & 0xFF, outfile);
+    fputc((startaddr - base) & 0xFF, outfile);
   }
+  return EOF;
+}
+
+/**
+ * @fn FILE *reopen(FILE **stream, const char *name, const char *mode, char *buf)
+ * @brief Opens a file, reusing a stream from a previous file if there is one.
+ * @details
+ *   The stream is given a static buffer, so after the first file
+ *   in a batch, opening further files does not allocate memory.
+ * @param stream Stream to reuse, or NULL. Updated with the stream opened.
+ * @param name Filename.
+ * @param mode fopen(3) mode.
+ * @param buf Buffer of BUFSIZ bytes for the stream.
+ * @return The stream, or NULL on error.
+ */
+FILE *reopen(FILE **stream, const char *name, const char *mode, char *buf)
+{
+  *stream = (*stream == NULL) ? fopen(name, mode) : freopen(name, mode, *stream);
+  if (*stream != NULL) setvbuf(*stream, buf, _IOFBF, BUFSIZ);
+  return *stream;
+}
+
+/**
+ * @fn int convert(const char *inname, const char *outname)
+ * @brief Converts one file, going through records until EOF or error.
+ * @details
+ *   When merging, the memory image is cleared first, keeping its pages
+ *   for reuse. The size of the input file is left in insize,
+ *   or -1 if not opened.
+ * @param inname Input filename.
+ * @param outname Output filename.
+ * @return EOF on success, otherwise an error code as from record(), or 'W' if the output can't be written.
+ */
+int convert(const char *inname, const char *outname)
+{
+  FILE *infile, *outfile;
+  int rectype = 0;
+  struct stat st;
+
+  memclear(&mem);
+  havestart = 0;
 
   // Open files for input and output
-  infile = fopen(argv[1], "rt");
-  outfile = fopen(argv[2], "wb");
+  insize = -1;
+  infile = reopen(&instream, inname, "rt", inbuf);
+  outfile = reopen(&outstream, outname, "wb", outbuf);
+  if (infile != NULL && fstat(fileno(infile), &st) == 0) insize = st.st_size;
   if (infile == NULL) {
-    fprintf(stderr, "Error opening file %s for input.\n", argv[1]);
+    fprintf(stderr, "Error opening file %s for input.\n", inname);
   } else if (outfile == NULL) {
-    fprintf(stderr, "Error opening file %s for output.\n", argv[2]);
+    fprintf(stderr, "Error opening file %s for output.\n", outname);
 
   } else {
     // Loop processing records until EOF or error
     do {
       rectype = record(infile, outfile);
-    } while (rectype == '0' || rectype == '1' || rectype == '5' || rectype == '9');
+    } while (rectype >= '0' && rectype <= '9');
+    if (merge && rectype == EOF) rectype = flush(outfile);
 
     if (rectype != EOF) {
-      fprintf(stderr, "Error %c before offset %04X in input file.\n", rectype, (int) ftell(infile));
+      fprintf(stderr, "Error %c before offset %04X in input file %s.\n", rectype, (int) ftell(infile), inname);
+    } else if (fflush(outfile)) {
+      fprintf(stderr, "Error writing file %s.\n", outname);
+      rectype = 'W';
+    }
+  }
+  return rectype;
+}
+
+/**
+ * @fn int batch(const char *listname)
+ * @brief Converts each pair of files in a list.
+ * @details
+ *   Each line of the list holds an input and an output filename,
+ *   separated by whitespace. Blank lines and lines starting with #
+ *   are skipped. A result line is output for each file:
+ *   OK or ERR, the input size in bytes, the input and output filenames.
+ * @param listname List filename, or - for standard input.
+ * @return Number of files which failed to convert, or -1 if the list can't be opened.
+ */
+int batch(const char *listname)
+{
+  FILE *list;
+  char *inname, *outname;
+  int rectype, failed = 0;
+
+  list = strcmp("-", listname) ? fopen(listname, "rt") : stdin;
+  if (list == NULL) {
+    fprintf(stderr, "Error opening file %s for input.\n", listname);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), list) != NULL) {
+    inname = strtok(line, " \t\r\n");
+    if (inname == NULL || *inname == '#') continue;
+    outname = strtok(NULL, " \t\r\n");
+    if (outname == NULL) {
+      fprintf(stderr, "No output filename for %s in list.\n", inname);
+      failed++;
+      continue;
     }
+    rectype = convert(inname, outname);
+    printf("%s %ld %s %s\n", (rectype == EOF) ? "OK" : "ERR", insize, inname, outname);
+    if (rectype != EOF) failed++;
   }
 
-  if (infile != NULL) fclose(infile);
-  if (outfile != NULL) fclose(outfile);
-  return (rectype == EOF) ? EXIT_SUCCESS : EXIT_FAILURE;
+  if (list != stdin) fclose(list);
+  return failed;
+}
+
+/**
+ * @fn void usage(const char *cmd)
+ * @brief Outputs help for the command.
+ * @param cmd Name of the program file, most likely from argv[0].
+ */
+void usage(const char *cmd)
+{
+  fprintf(stderr, "\
+Motorola S-record to FLEX binary converter\n\
+Usage: %s [-m] [-b base] [-h] infile outfile\n\
+       %s [-m] [-b base] -l listfile\n\
+\t-m merges all data in memory, and outputs it in address order\n\
+\t   as records as long as possible\n\
+\t-b selects the 64K window starting at base (hex) from S2/S3 data,\n\
+\t   data outside it is skipped\n\
+\t-l converts each \"infile outfile\" pair listed, one per line,\n\
+\t   outputting OK or ERR, input size and filenames for each\n\
+\t-h prints this message\n\
+Without -m, output records are the same size as input records, so may not\n\
+be as large as possible even where data is contiguous.\n\
+Output is not padded to a multiple of 252 bytes in size.\n\
+", cmd, cmd);
+  exit(EXIT_FAILURE);
+}
+
+/**
+ * @fn int main(int argc, char *argv[])
+ * @brief Main function
+ * @details Parse options, then convert one file or a list of files
+ * @param argc Command-line argument count
+ * @param argv Command-line arguments
+ * @return Zero on success, non-zero on error
+ */
+int main(int argc, char *argv[])
+{
+  int opt, result;
+  char *end, *listname = NULL;
+
+  while ((opt = getopt(argc, argv, "mb:l:h")) != -1) {
+    switch (opt) {
+      case 'm': // Merge
+        merge = 1;
+        break;
+      case 'b': // Window base
+        base = strtoul(optarg, &end, 16);
+        if (*optarg == '\0' || *end != '\0' || base > 0xFFFFFFFFUL) usage(argv[0]);
+        window = 1;
+        break;
+
+      case 'l': // Batch list
+        listname = optarg;
+        break;
+
+      case 'h': // Help/usage
+      case '?':
+      default:
+        usage(argv[0]);
+    }
+  }
+  meminit(&mem);
+
+  if (listname) {
+    // Batch of files
+    if (argc != optind) usage(argv[0]);
+    result = batch(listname) ? EXIT_FAILURE : EXIT_SUCCESS;
+
+  } else {
+    if (argc - optind != 2) usage(argv[0]);
+    result = (convert(argv[optind], argv[optind + 1]) == EOF) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  if (instream != NULL) fclose(instream);
+  if (outstream != NULL) fclose(outstream);
+  memfree(&mem);
+  return result;
 }